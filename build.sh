@@ -34,12 +34,20 @@ then
     for map in ${maps[@]}
     do
         wget http://www.mariouniverse.com/wp-content/img/maps/snes/smk/${map}.png
+        # bottom-up and uncompressed: rows are copied once instead of being RLE decoded
         convert ${map}.png -colors 256 -compress none BMP3:${map}.bmp
-        # this second convert is required for some image to force removal of RLE compression
-        convert ${map}.bmp -colors 256 -compress none BMP3:${map}.bmp
         mv ${map}.bmp assets/maps
         rm ${map}.png
     done
 fi
 
-gcc -Werror -O3 main.c -lncurses -lm -o build/term-mode7
+cflags=()
+if [[ ${TRACE:-0} == 1 ]]
+then
+    cflags+=(-DENABLE_TRACE)
+fi
+
+gcc -Werror -O3 "${cflags[@]}" -c mode7.c -o build/mode7.o
+ar rcs build/libmode7.a build/mode7.o
+
+gcc -Werror -O3 "${cflags[@]}" main.c -Lbuild -lmode7 -lncursesw -lm -lpthread -lrt -o build/term-mode7
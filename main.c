@@ -1,99 +1,260 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
-#include <float.h>
 #include <time.h> 
+#include <locale.h>
 
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <termios.h>
+
+#include <pthread.h>
+#include <linux/perf_event.h>
 
 #include <ncurses.h>
 
+#include "mode7.h"
+
 static void terminate_ncurses(void);
-static void restore_colors(void);
 
-typedef struct {
-    size_t width;
-    size_t height;
-    uint8_t * data;
-    uint8_t colors[256][4];
-} image_t;
+#define KB_EVENT_RELEASE 0x8000
 
-static image_t * image_create(const char * file_name);
-static void image_quantize(image_t * image, size_t max_color_count);
-static image_t * image_create_downsized_copy(const image_t * image, size_t w, size_t h);
-static void image_destroy(image_t * image);
+/* press count and last time of every key, to synthesize releases */
+typedef struct {
+    struct {
+        size_t count;
+        size_t last_time_ms;
+    } pressed_keys[512];
+} kb_state_t;
+
+static int kb_event_get(kb_state_t * state);
+static int kb_keys_held(const kb_state_t * state);
+
+/*
+ * Idle wait: when nothing changed, the loop blocks on stdin instead of sleeping 5ms
+ * per frame. SIGWINCH is blocked outside of the wait, so that a resize can not be
+ * missed between the last check and the wait.
+ */
+static void idle_signals_init(sigset_t * wait_mask);
+static void idle_wait(int timeout_ms, const sigset_t * wait_mask);
+
+/*
+ * Asynchronous terminal output: once started, ncurses writes to a pipe which
+ * is copied to the terminal by a dedicated writer thread, so that a stalled
+ * terminal does not block the render loop.
+ *
+ * A frame is only encoded (doupdate()) when the previous one has been fully
+ * written, the frames rendered meanwhile are coalesced in ncurses's virtual
+ * screen: the newest frame always wins and nothing queues up.
+ */
+#define OUTPUT_MAX_FRAMES 4
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
 
 typedef struct {
-    image_t * image;
-    size_t ratio;
-} texture_mimap_t;
+    int active;
+    int sync_update;
+    int tty_fd;
+    int pipe_fd;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    /* byte counters, frame ends are expressed in read_total units */
+    size_t read_total;
+    size_t written_total;
+    size_t frame_ends[OUTPUT_MAX_FRAMES];
+    size_t submitted_count;
+    size_t presented_count;
+    size_t skipped_count;
+    /* capture to present latency, smoothed, and how far from it frames were predicted */
+    size_t frame_capture_ns[OUTPUT_MAX_FRAMES];
+    size_t frame_predicted_latency_ns[OUTPUT_MAX_FRAMES];
+    float latency_ns;
+    float latency_error_ns;
+    /* only used by the writer thread */
+    char buffer[OUTPUT_BUFFER_SIZE];
+} output_t;
+
+static int output_detect_sync_update(void);
+static int output_start(output_t * output, int sync_update);
+static void output_stop(output_t * output);
+static int output_ready(output_t * output);
+static void output_frame_begin(const output_t * output);
+static void output_frame_end(const output_t * output);
+static void output_submit(output_t * output, size_t capture_ns, size_t predicted_latency_ns);
+static void output_latency(output_t * output, float * latency_ns, float * latency_error_ns);
+static void output_sync_size(const output_t * output);
+static void output_scroll(int top, int bottom, long count);
+
+/* stopped by terminate_ncurses() */
+static output_t * active_output = NULL;
+
+/* terminal palette before the demo and as currently set, restored by terminate_ncurses() */
+static palette_backup_t palette_backup;
+static palette_shadow_t palette_shadow;
+
+/* palette cycling effect, steps per second */
+#define PALETTE_CYCLE_RATE 6
+
+static size_t palette_water_indices(uint8_t colors[][4], const uint8_t * used_colors, uint8_t * indices);
+
+/*
+ * Minimap: the whole map from above, from the coarsest mipmap level, in a screen corner,
+ * with a marker per camera and a dot ahead of it for its heading. It is an overlay:
+ * markers only invalidate the cells they leave and enter. Sizes in cells.
+ */
+#define MINIMAP_WIDTH 24
+#define MINIMAP_HEIGHT 12
+#define MINIMAP_MAX_MARKERS 2
 
 typedef struct {
-    texture_mimap_t mipmaps[8];
-    size_t mipmap_count;
-} texture_t;
+    vec2_t position;      /* in texels */
+    float orientation;
+} minimap_marker_t;
 
-static texture_t * texture_create(const char * file_name, size_t max_color_count, size_t mipmap_count);
-static void texture_destroy(texture_t * texture);
+typedef struct {
+    overlay_t overlay;
+    uint8_t * background;
+    const texture_mimap_t * level;
+    size_t block_width;
+    size_t block_height;
+    uint8_t marker_color;
+    uint8_t heading_color;
+    /* marker and heading cells currently drawn */
+    long cells[MINIMAP_MAX_MARKERS * 2][2];
+    size_t cell_count;
+} minimap_t;
+
+static void minimap_init(minimap_t * minimap);
+static void minimap_reset(minimap_t * minimap);
+static int minimap_update(
+    minimap_t * minimap,
+    const texture_t * texture,
+    size_t block_width,
+    size_t block_height,
+    const minimap_marker_t * markers,
+    size_t marker_count
+);
+static void minimap_destroy(minimap_t * minimap);
+
+/*
+ * Frame export: rendered framebuffers are published into a POSIX shared memory ring
+ * for external readers (recording, post-processing). Layout, native endianness:
+ *   header: "TM7FB001", slot count, slot capacity in pixels (u32), slot size in bytes,
+ *           latest published frame number + 1 (u64, 0 before the first frame)
+ *   slots from FRAME_EXPORT_HEADER_SIZE, slot size bytes each, frame n in slot n % slot count
+ * Slots are seqlocks: the sequence is odd while the slot is written. Readers read the
+ * sequence, copy or use the slot in place, then retry if the sequence was odd or changed.
+ * The writer never waits on readers.
+ */
+#define FRAME_EXPORT_MAGIC "TM7FB001"
+#define FRAME_EXPORT_SLOTS 4
+#define FRAME_EXPORT_CAPACITY (1024 * 1024)
+#define FRAME_EXPORT_HEADER_SIZE 64
 
 typedef struct {
-    float nums[3][3];
-} mat3_t;
+    char magic[8];
+    uint32_t slot_count;
+    uint32_t slot_capacity;
+    uint64_t slot_size;
+    uint64_t latest;
+} frame_export_header_t;
 
 typedef struct {
-    float x, y;
-} vec2_t;
+    uint64_t sequence;
+    uint64_t frame;
+    uint64_t timestamp_ns;    /* CLOCK_MONOTONIC, camera capture time */
+    uint32_t width;
+    uint32_t height;
+    uint8_t colors[256][4];
+    uint8_t pixels[];         /* palette indices, row-major */
+} frame_export_slot_t;
 
-static void mat3_identity(mat3_t * m);
-static void mat3_copy(mat3_t * a, const mat3_t * b);
-static void mat3_mult(mat3_t * a, const mat3_t * b);
-static void mat3_translate(mat3_t * m, float x, float y);
-static void mat3_scale(mat3_t * m, float x, float y);
-static void mat3_rotate(mat3_t * m, float x);
-static void mat3_transform(const mat3_t * m, vec2_t * v);
+typedef struct {
+    const char * name;
+    void * mapping;
+    size_t size;
+    size_t slot_size;
+    size_t published_count;
+    size_t dropped_count;
+} frame_export_t;
+
+static void frame_export_init(frame_export_t * frame_export);
+static int frame_export_open(frame_export_t * frame_export, const char * name);
+static void frame_export_publish(
+    frame_export_t * frame_export,
+    const framebuffer_t * framebuffer,
+    uint8_t colors[][4],
+    size_t frame,
+    size_t timestamp_ns
+);
+static void frame_export_close(frame_export_t * frame_export);
 
-static float wrap_repeat(float v, float min, float max);
+typedef struct {
+    const char * file_name;
+    size_t default_color_count;
+    size_t padding_box_size;
+    vec2_t padding_box_pos;
+} map_t;
 
-static void renderer256_init(uint8_t colors[][4]);
-static void renderer256_draw(size_t x, size_t y, uint8_t colors[][4], uint8_t color_idx);
-static void renderer16_init(uint8_t colors[][4]);
-static void renderer16_draw(size_t x, size_t y, uint8_t colors[][4], uint8_t color_idx);
-static void renderer1_init(uint8_t colors[][4]);
-static void renderer1_draw(size_t x, size_t y, uint8_t colors[][4], uint8_t color_idx);
+#define GOLDEN_DEFAULT_FILE "assets/golden.txt"
+/* reference texel coordinates closer than this to a texel edge may round either way */
+#define GOLDEN_EDGE_TOLERANCE (1 / 32.f)
+#define GOLDEN_REPORTED_PIXELS 16
 
-static size_t current_time_ns(void);
+static int golden_run(const map_t * maps, size_t map_count, const char * file_name, int record);
 
-#define KB_EVENT_RELEASE 0x8000
-static int kb_event_get();
+/* hardware counters of the calling thread, opened as one group */
+#define PERF_COUNTER_COUNT 5
 
 typedef struct {
-    float acceleration;
-    float deceleration;
-    float max;
+    int fds[PERF_COUNTER_COUNT];   /* cycles, instructions, L1D read misses, LLC misses, branch misses */
+    int error;
+} perf_counters_t;
 
-    size_t last_time_ms;
-    float velocity;
+static int perf_counters_open(perf_counters_t * counters);
+static int perf_counters_read(const perf_counters_t * counters, uint64_t values[PERF_COUNTER_COUNT]);
+static void perf_counters_close(perf_counters_t * counters);
 
-    int active;
-    int reverse;
-} accelerator_t;
+#define BENCH_DEFAULT_FRAMES 100
+#define BENCH_WIDTH 159
+#define BENCH_HEIGHT 46
+
+enum {
+    BENCH_STAGE_SAMPLING,
+    BENCH_STAGE_MAPPING,
+    BENCH_STAGE_ENCODING,
+    BENCH_STAGE_COUNT
+};
 
-static void accelerator_init(accelerator_t * accelerator, float acceleration, float deceleration, float max);
-static void accelerator_press(accelerator_t * accelerator, int reverse);
-static void accelerator_release(accelerator_t * accelerator);
-static float accelerator_step_distance(accelerator_t * accelerator);
-static float accelerator_velocity(const accelerator_t * accelerator);
+typedef struct {
+    size_t ns;
+    uint64_t counters[PERF_COUNTER_COUNT];
+    size_t start_ns;
+    uint64_t start_counters[PERF_COUNTER_COUNT];
+} bench_stage_t;
+
+static int bench_run(const map_t * maps, size_t map_count, size_t frame_count);
+static int bench_lod_run(const map_t * maps, size_t map_count, size_t frame_count);
 
-int main()
+int main(int argc, char ** argv)
 {
-    const struct {
-        const char * file_name;
-        size_t default_color_count;
-        size_t padding_box_size;
-        vec2_t padding_box_pos;
-    } maps[] = {
+    TRACE_THREAD_NAME("main");
+
+#ifdef ENABLE_TRACE
+    atexit(trace_dump);
+#endif
+
+    const map_t maps[] = {
         {"assets/maps/mariocircuit-1.bmp", 15, 8, {0, 1016}},
         {"assets/maps/ghostvalley-3.bmp", 12, 8, {0, 0}},
         {"assets/maps/bowsercastle-3.bmp", 8, 8, {32, 40}},
@@ -109,17 +270,103 @@ int main()
 
     size_t color_count = maps[current_map].default_color_count;
     size_t mipmap_count = 5;
-    texture_t * texture = texture_create(
-        maps[current_map].file_name,
-        color_count,
-        mipmap_count
-    );
+    texture_t * texture = NULL;
+    vtexture_t * vtexture = NULL;
+    const char * vtexture_file_name = NULL;
+
+    if (argc >= 4 && argc <= 6 && strcmp(argv[1], "--make-vt") == 0) {
+        texture = texture_create(
+            argv[2],
+            argc >= 5 ? strtoul(argv[4], NULL, 10) : 256,
+            argc >= 6 ? strtoul(argv[5], NULL, 10) : 8
+        );
+
+        if (!texture || !texture_wait(texture)) {
+            fprintf(stderr, "Cannot read image: %s\n", argv[2]);
+            exit(1);
+        }
+
+        if (!vtexture_write(texture, argv[3])) {
+            fprintf(stderr, "Cannot write virtual texture: %s\n", argv[3]);
+            exit(1);
+        }
+
+        texture_destroy(texture);
+
+        return 0;
+    }
+
+    if (argc >= 2 && argc <= 3 && (strcmp(argv[1], "--check-golden") == 0 || strcmp(argv[1], "--record-golden") == 0)) {
+        return golden_run(
+            maps,
+            map_count,
+            argc == 3 ? argv[2] : GOLDEN_DEFAULT_FILE,
+            strcmp(argv[1], "--record-golden") == 0
+        ) ? 0 : 1;
+    }
+
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "--bench") == 0) {
+        return bench_run(maps, map_count, argc == 3 ? strtoul(argv[2], NULL, 10) : BENCH_DEFAULT_FRAMES) ? 0 : 1;
+    }
+
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "--bench-lod") == 0) {
+        return bench_lod_run(maps, map_count, argc == 3 ? strtoul(argv[2], NULL, 10) : BENCH_DEFAULT_FRAMES) ? 0 : 1;
+    }
+
+    const char * export_name = NULL;
+    int arg;
+    for (arg = 1; arg < argc; arg++) {
+        if (arg + 1 < argc && strcmp(argv[arg], "--vt") == 0) {
+            vtexture_file_name = argv[++arg];
+        } else if (arg + 1 < argc && strcmp(argv[arg], "--export") == 0) {
+            export_name = argv[++arg];
+        } else {
+            fprintf(
+                stderr,
+                "Usage: %s [--vt file.vt] [--export /shm-name] | --make-vt in.bmp out.vt [colors [mipmaps]] | --check-golden [file] | --record-golden [file] | --bench [frames] | --bench-lod [frames]\n",
+                argv[0]
+            );
+            exit(1);
+        }
+    }
+
+    /* before any thread is started, they inherit the blocked SIGWINCH */
+    sigset_t idle_wait_mask;
+    idle_signals_init(&idle_wait_mask);
 
-    if (!texture) {
-        fprintf(stderr, "Cannot read image: %s\n", maps[current_map].file_name);
+    frame_export_t frame_export;
+    frame_export_init(&frame_export);
+    if (export_name && !frame_export_open(&frame_export, export_name)) {
+        fprintf(stderr, "Cannot create shared memory: %s: %s\n", export_name, strerror(errno));
         exit(1);
     }
 
+    if (vtexture_file_name) {
+        vtexture = vtexture_open(vtexture_file_name);
+        if (!vtexture) {
+            fprintf(stderr, "Cannot read virtual texture: %s\n", vtexture_file_name);
+            exit(1);
+        }
+    } else {
+        texture = texture_create(
+            maps[current_map].file_name,
+            color_count,
+            mipmap_count
+        );
+
+        if (!texture) {
+            fprintf(stderr, "Cannot read image: %s\n", maps[current_map].file_name);
+            exit(1);
+        }
+    }
+
+    /* texture palettes are known once their loader has produced level 0 */
+    uint8_t (*colors)[4] = vtexture ? vtexture->colors : NULL;
+
+    /* has to be queried before ncurses takes over the terminal */
+    const int sync_update = output_detect_sync_update();
+
+    setlocale(LC_ALL, "");
     initscr();
     atexit(terminate_ncurses);
 
@@ -128,120 +375,283 @@ int main()
     curs_set(0);
     noecho();
     start_color();
-    restore_colors();
-
-    static struct {
-        const char * name;
-        void (*init)(uint8_t [][4]);
-        void (*draw)(size_t, size_t, uint8_t [][4], uint8_t);
-    } renderers[] = {
-        {"monochrome", renderer1_init, renderer1_draw},
-        {"16 colors", renderer16_init, renderer16_draw},
-        {"256 colors", renderer256_init, renderer256_draw},
-    };
+    palette_backup_save(&palette_backup);
+    palette_shadow_init(&palette_shadow);
+
+    output_t output;
+    if (output_start(&output, sync_update)) {
+        active_output = &output;
+    }
 
+    /* braille glyphs need a multibyte (UTF-8) locale */
+    const size_t first_renderer = MB_CUR_MAX > 1 ? 0 : 1;
     const int true_color_support = can_change_color() && COLORS >= 256;
-    const size_t renderer_count = true_color_support ? 3 : 2;
+    const size_t renderer_count = true_color_support ? 4 : 3;
     size_t current_renderer = renderer_count - 1;
 
-    renderers[current_renderer].init(texture->mipmaps[0].image->colors);
+    renderer_context_t renderer_context;
+    renderer_context_init(&renderer_context, &renderers[current_renderer], stdscr, &palette_shadow);
+
+    if (colors) {
+        renderer_context.renderer->init(&renderer_context, colors);
+    }
+
+    /* water colors of the palette, rotated through palette uploads only */
+    int palette_cycling = 0;
+    uint8_t cycle_indices[256];
+    size_t cycle_count = 0;
+    size_t cycle_phase = SIZE_MAX;
+    uint8_t cycled_colors[256][4];
+
+    if (colors) {
+        cycle_count = palette_water_indices(colors, NULL, cycle_indices);
+    }
 
     const vec2_t default_position = {860, 758};
-    vec2_t position = default_position;
     /* fix broken ratio since pixels are not square */
     const vec2_t default_scale = {1 * 0.08, 1.8 * 0.08};
-    vec2_t scale = default_scale;
 
-    float orientation = 0;
+    enum {
+        CAMERA_PLAYER1,
+        CAMERA_PLAYER2,
+        CAMERA_COUNT
+    };
+
+    camera_t cameras[CAMERA_COUNT];
+    camera_init(&cameras[CAMERA_PLAYER1], default_position, default_scale, 0);
+    camera_init(&cameras[CAMERA_PLAYER2], default_position, default_scale, 0);
+    cameras[CAMERA_PLAYER2].position.x -= 40;
+
+    camera_t * const camera = &cameras[CAMERA_PLAYER1];
+
+    const char * const layouts[] = {
+        "single",
+        "split",
+        "rear view",
+    };
+
+    const size_t layout_count = sizeof(layouts) / sizeof(layouts[0]);
+    size_t current_layout = 0;
+
+    viewport_t viewports[2];
+    size_t viewport_count = 0;
+    size_t i;
+    for (i = 0; i < sizeof(viewports) / sizeof(viewports[0]); i++) {
+        scanline_table_init(&viewports[i].scanline_table);
+    }
+
+    framebuffer_t framebuffer;
+    framebuffer_init(&framebuffer);
+
+    minimap_t minimap;
+    minimap_init(&minimap);
+    int minimap_enabled = 1;
+    int minimap_shown = 0;
+    size_t minimap_renderer = SIZE_MAX;
+
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    render_pool_t render_pool;
+    if (!render_pool_init(&render_pool, cpu_count > 1 ? cpu_count - 1 : 0)) {
+        fprintf(stderr, "Cannot start render threads\n");
+        exit(1);
+    }
+
+    camera_t previous_cameras[CAMERA_COUNT];
+    memcpy(previous_cameras, cameras, sizeof(cameras));
+    size_t simulation_time_ns = current_time_ns();
+
+    camera_t render_cameras[CAMERA_COUNT];
+    int latency_compensation = 1;
+
     int perspective = 1;
+    scanline_effect_t scanline_effect = NULL;
     size_t rendered_frame_count = 0;
 
-    accelerator_t move_accelerator;
-    accelerator_init(&move_accelerator, 600, 150, 150);
-
-    accelerator_t turn_accelerator;
-    accelerator_init(&turn_accelerator, M_PI * 0.3, M_PI * 8, M_PI * 0.8);
+    kb_state_t kb_state;
+    memset(&kb_state, 0, sizeof(kb_state));
+
+    /* last camera drawn in a single view without perspective, to shift what the terminal shows */
+    camera_t shift_camera;
+    int shift_valid = 0;
+    int shift_width = 0;
+    int shift_height = 0;
+    size_t shift_renderer = 0;
+    /* rows the screen has been scrolled by since the last encoded frame */
+    long pending_scroll = 0;
+
+    /* state shown by the last drawn frame, nothing is sampled nor sent while it does not change */
+    camera_t drawn_cameras[CAMERA_COUNT];
+    int drawn_width = -1;
+    int drawn_height = -1;
+    int frame_skipped = 0;
+    int status_pending = 0;
+    int idle = 0;
+    int idle_timeout_ms = -1;
 
     int stop = 0;
     while (!stop) {
-        usleep(5 * 1000);
+        TRACE_ZONE("frame");
+
+        {
+            TRACE_ZONE("sleep");
+            if (idle) {
+                idle_wait(idle_timeout_ms, &idle_wait_mask);
+            } else {
+                usleep(5 * 1000);
+            }
+        }
+
+        idle = 0;
 
-        const int evt = kb_event_get();
+        const int evt = kb_event_get(&kb_state);
         switch (evt) {
             case 'q':
                 stop = 1;
                 break;
 
             case KEY_UP:
-                accelerator_press(&move_accelerator, 0);
+                accelerator_press(&camera->move_accelerator, 0);
                 break;
 
             case KEY_UP | KB_EVENT_RELEASE:
-                accelerator_release(&move_accelerator);
+                accelerator_release(&camera->move_accelerator);
                 break;
 
             case KEY_DOWN:
-                accelerator_press(&move_accelerator, 1);
+                accelerator_press(&camera->move_accelerator, 1);
                 break;
 
             case KEY_DOWN | KB_EVENT_RELEASE:
-                accelerator_release(&move_accelerator);
+                accelerator_release(&camera->move_accelerator);
                 break;
 
             case KEY_LEFT:
-                accelerator_press(&turn_accelerator, 1);
+                accelerator_press(&camera->turn_accelerator, 1);
                 break;
 
             case KEY_LEFT | KB_EVENT_RELEASE:
-                accelerator_release(&turn_accelerator);
+                accelerator_release(&camera->turn_accelerator);
                 break;
 
             case KEY_RIGHT:
-                accelerator_press(&turn_accelerator, 0);
+                accelerator_press(&camera->turn_accelerator, 0);
                 break;
 
             case KEY_RIGHT | KB_EVENT_RELEASE:
-                accelerator_release(&turn_accelerator);
+                accelerator_release(&camera->turn_accelerator);
+                break;
+
+            case 'w':
+                accelerator_press(&cameras[CAMERA_PLAYER2].move_accelerator, 0);
+                break;
+
+            case 'w' | KB_EVENT_RELEASE:
+            case 's' | KB_EVENT_RELEASE:
+                accelerator_release(&cameras[CAMERA_PLAYER2].move_accelerator);
+                break;
+
+            case 's':
+                accelerator_press(&cameras[CAMERA_PLAYER2].move_accelerator, 1);
+                break;
+
+            case 'a':
+                accelerator_press(&cameras[CAMERA_PLAYER2].turn_accelerator, 1);
+                break;
+
+            case 'a' | KB_EVENT_RELEASE:
+            case 'd' | KB_EVENT_RELEASE:
+                accelerator_release(&cameras[CAMERA_PLAYER2].turn_accelerator);
+                break;
+
+            case 'd':
+                accelerator_press(&cameras[CAMERA_PLAYER2].turn_accelerator, 0);
                 break;
 
             case 'e':
-                position.x -= 5 * cosf(orientation);
-                position.y -= 5 * sinf(orientation);
+                camera->position.x -= 5 * cosf(camera->orientation);
+                camera->position.y -= 5 * sinf(camera->orientation);
                 break;
 
             case 'r':
-                position.x += 5 * cosf(orientation);
-                position.y += 5 * sinf(orientation);
+                camera->position.x += 5 * cosf(camera->orientation);
+                camera->position.y += 5 * sinf(camera->orientation);
                 break;
 
             case 'v':
-                scale.x *= 1.1;
-                scale.y *= 1.1;
+                camera->scale.x *= 1.1;
+                camera->scale.y *= 1.1;
                 break;
 
             case 'b':
-                scale.x /= 1.1;
-                scale.y /= 1.1;
+                camera->scale.x /= 1.1;
+                camera->scale.y /= 1.1;
                 break;
 
             case 'c':
-                position = default_position;
-                scale = default_scale;
-                orientation = 0;
+                for (i = 0; i < CAMERA_COUNT; i++) {
+                    cameras[i].position = default_position;
+                    cameras[i].scale = default_scale;
+                    cameras[i].orientation = 0;
+                }
+
+                cameras[CAMERA_PLAYER2].position.x -= 40;
+                /* teleport, do not interpolate from the old position */
+                memcpy(previous_cameras, cameras, sizeof(cameras));
                 break;
 
             case 'p':
                 perspective = !perspective;
                 break;
 
+            case 't':
+                latency_compensation = !latency_compensation;
+                break;
+
+            case 'f':
+                scanline_effect = scanline_effect ? NULL : scanline_effect_wave;
+                break;
+
+            case 'T':
+                TRACE_DUMP();
+                break;
+
+            case 'M':
+                minimap_enabled = !minimap_enabled;
+                break;
+
+            case 'n':
+                current_layout++;
+                if (current_layout >= layout_count) {
+                    current_layout = 0;
+                }
+
+                break;
+
             case 'g':
                 current_renderer++;
                 if (current_renderer >= renderer_count) {
-                    current_renderer = 0;
+                    current_renderer = first_renderer;
+                }
+
+                palette_backup_restore(&palette_backup, &palette_shadow);
+                attrset(A_NORMAL);
+
+                renderer_context_init(&renderer_context, &renderers[current_renderer], stdscr, &palette_shadow);
+                if (colors) {
+                    renderer_context.renderer->init(&renderer_context, colors);
+                }
+
+                cycle_phase = SIZE_MAX;
+
+                break;
+
+            case 'o':
+                palette_cycling = !palette_cycling;
+                if (colors && !palette_cycling) {
+                    renderer_context.renderer->init(&renderer_context, colors);
                 }
 
-                restore_colors();
-                renderers[current_renderer].init(texture->mipmaps[0].image->colors);
+                cycle_phase = SIZE_MAX;
 
                 break;
 
@@ -250,6 +660,10 @@ int main()
             case 'k':
             case 'l':
             case 'm':
+                if (vtexture) {
+                    break;
+                }
+
                 if (evt == 'h') {
                     mipmap_count--;
                 }
@@ -299,861 +713,2170 @@ int main()
                     exit(1);
                 }
 
-                renderers[current_renderer].init(texture->mipmaps[0].image->colors);
+                colors = NULL;
 
                 break;
         }
 
-        const float move_distance = accelerator_step_distance(&move_accelerator);
-        position.y -= move_distance * cosf(orientation);
-        position.x += move_distance * sinf(orientation);
+        if (texture && texture_failed(texture)) {
+            fprintf(stderr, "Cannot load image: %s\n", maps[current_map].file_name);
+            exit(1);
+        }
+
+        if (!colors && texture_ready(texture)) {
+            colors = texture->colors;
+            renderer_context.renderer->init(&renderer_context, colors);
+            cycle_count = palette_water_indices(colors, texture->used_colors, cycle_indices);
+            minimap_reset(&minimap);
+            cycle_phase = SIZE_MAX;
+        }
+
+        /* advance simulation up to now in fixed steps */
+        const size_t capture_ns = current_time_ns();
+        if (capture_ns - simulation_time_ns > (size_t)SIMULATION_MAX_STEPS * SIMULATION_STEP_NS) {
+            simulation_time_ns = capture_ns - (size_t)SIMULATION_MAX_STEPS * SIMULATION_STEP_NS;
+        }
+
+        while (capture_ns - simulation_time_ns >= SIMULATION_STEP_NS) {
+            memcpy(previous_cameras, cameras, sizeof(cameras));
+            for (i = 0; i < CAMERA_COUNT; i++) {
+                camera_step(&cameras[i], 1.f / SIMULATION_RATE);
+            }
+
+            simulation_time_ns += SIMULATION_STEP_NS;
+        }
+
+        /*
+         * render cameras as they should be when the frame will be presented,
+         * interpolated states lag one step behind the current time
+         */
+        const float simulation_alpha = (float)(capture_ns - simulation_time_ns) / SIMULATION_STEP_NS;
+        float latency_ns, latency_error_ns;
+        output_latency(&output, &latency_ns, &latency_error_ns);
+        const size_t predicted_latency_ns = latency_compensation ? latency_ns : 0;
+        const size_t prediction_ns = predicted_latency_ns + (latency_compensation ? SIMULATION_STEP_NS : 0);
+
+        for (i = 0; i < CAMERA_COUNT; i++) {
+            camera_t interpolated;
+            camera_interpolate(&previous_cameras[i], &cameras[i], simulation_alpha, &interpolated);
+            camera_predict(&interpolated, prediction_ns / 1e9f, &render_cameras[i]);
+        }
 
-        orientation += accelerator_step_distance(&turn_accelerator);
+        output_sync_size(&output);
 
         int scr_w, scr_h;
         getmaxyx(stdscr, scr_h, scr_w);
         scr_w -= 1;
         scr_h -= 2;
 
-        const vec2_t center = {scr_w / 2.f, scr_h * 0.8};
-        size_t rendered_pixel_count = 0;
-        int i, j;
-
-        for (i = 0; i < scr_h; i++) {
-            mat3_t view_mat;
-            mat3_identity(&view_mat);
-            mat3_translate(&view_mat, position.x, position.y);
-            mat3_translate(&view_mat, center.x, center.y);
-            mat3_rotate(&view_mat, orientation);
-
-            /*
-             * This formula should be rewrote, simplified and parametrized (fov, perspective angle)
-             */
-            vec2_t perspective_factor = {
-                (scr_w / (i + 1.f)),
-                (((i + 1.f) / scr_h) + 3 * scr_w / scr_h)
-                    / ((i + 1.f) / scr_h)
-            };
+        if (scr_w < 0 || scr_h < 0) {
+            scr_w = 0;
+            scr_h = 0;
+        }
+
+        const size_t cycle_period_ns = 1000 * 1000 * 1000 / PALETTE_CYCLE_RATE;
+        const int cycling = colors && palette_cycling && cycle_count > 1;
+
+        int cameras_moved = 0;
+        for (i = 0; i < CAMERA_COUNT && drawn_width >= 0; i++) {
+            cameras_moved |= 0
+                || render_cameras[i].position.x != drawn_cameras[i].position.x
+                || render_cameras[i].position.y != drawn_cameras[i].position.y
+                || render_cameras[i].scale.x != drawn_cameras[i].scale.x
+                || render_cameras[i].scale.y != drawn_cameras[i].scale.y
+                || render_cameras[i].orientation != drawn_cameras[i].orientation
+            ;
+        }
 
-            if (!perspective) {
-                perspective_factor.x = 30;
-                perspective_factor.y = perspective_factor.x;
+        const int changed = 0
+            || evt != ERR
+            || cameras_moved
+            || frame_skipped
+            || scr_w != drawn_width
+            || scr_h != drawn_height
+            || scanline_effect
+            || !colors
+            || (cycling && capture_ns / cycle_period_ns != cycle_phase)
+            || (texture && texture_ready_count(texture) < texture->mipmap_count)
+            || (vtexture && vtexture->frame_load_count > 0)
+        ;
+
+        if (!changed && !status_pending) {
+            /* held keys are released on timeouts, palette cycling steps on time */
+            if (!kb_keys_held(&kb_state)) {
+                idle = 1;
+                idle_timeout_ms = -1;
+                if (cycling) {
+                    idle_timeout_ms = (cycle_period_ns - capture_ns % cycle_period_ns) / (1000 * 1000) + 1;
+                }
             }
 
-            mat3_scale(
-                &view_mat,
-                scale.x * perspective_factor.x,
-                scale.y * perspective_factor.y
-            );
+            continue;
+        }
 
-            mat3_translate(&view_mat, -center.x, -center.y);
+        /*
+         * The status line is printed after a frame is encoded, one more frame shows it.
+         * Interleaved renderers only draw some colors per frame, that last frame before
+         * going idle draws every cell so that the image is left complete.
+         */
+        const int settling = !changed;
+        status_pending = changed;
+        memcpy(drawn_cameras, render_cameras, sizeof(render_cameras));
+        drawn_width = scr_w;
+        drawn_height = scr_h;
+
+        viewport_count = 1;
+        viewports[0].camera = &render_cameras[CAMERA_PLAYER1];
+        viewports[0].orientation_offset = 0;
+        viewports[0].x = 0;
+        viewports[0].y = 0;
+        viewports[0].width = scr_w;
+        viewports[0].height = scr_h;
+
+        if (current_layout == 1) {
+            viewport_count = 2;
+            /* the top view takes the middle row of an odd height, no row is left unrendered */
+            viewports[0].height = scr_h - scr_h / 2;
+            viewports[1].camera = &render_cameras[CAMERA_PLAYER2];
+            viewports[1].orientation_offset = 0;
+            viewports[1].x = 0;
+            viewports[1].y = scr_h - scr_h / 2;
+            viewports[1].width = scr_w;
+            viewports[1].height = scr_h / 2;
+        }
 
-            size_t mimap_idx = texture->mipmap_count - roundf(
-                ((i + 1) / (float) scr_h) * texture->mipmap_count
-            );
+        if (current_layout == 2) {
+            viewport_count = 2;
+            viewports[1].camera = &render_cameras[CAMERA_PLAYER1];
+            viewports[1].orientation_offset = M_PI;
+            viewports[1].width = scr_w / 3;
+            viewports[1].height = scr_h / 4;
+            viewports[1].x = (scr_w - viewports[1].width) / 2;
+            viewports[1].y = 1;
+        }
 
-            if (mimap_idx >= texture->mipmap_count) {
-                mimap_idx = texture->mipmap_count - 1;
-            }
+        /* viewports and framebuffer are in texels, block renderers sample several per cell */
+        const size_t block_width = renderers[current_renderer].block_width;
+        const size_t block_height = renderers[current_renderer].block_height;
+        for (i = 0; i < viewport_count; i++) {
+            viewports[i].x *= block_width;
+            viewports[i].y *= block_height;
+            viewports[i].width *= block_width;
+            viewports[i].height *= block_height;
+        }
 
-            texture_mimap_t * const mipmap = &texture->mipmaps[mimap_idx];
+        if (!framebuffer_resize(&framebuffer, scr_w * block_width, scr_h * block_height)) {
+            fprintf(stderr, "Cannot allocate framebuffer\n");
+            exit(1);
+        }
 
-            for (j = 0; j < scr_w; j++) {
-                vec2_t tx = {j, i};
-                mat3_transform(&view_mat, &tx);
+        const sampler_t sampler = {
+            texture,
+            vtexture,
+            texture ? maps[current_map].padding_box_pos : (vec2_t) {0, 0},
+            texture ? maps[current_map].padding_box_size : 0
+        };
+
+        /* later viewports overlap earlier ones */
+        for (i = 0; i < viewport_count; i++) {
+            viewport_t * const viewport = &viewports[i];
+            viewport->scanline_table.effect = scanline_effect;
+
+            if (!scanline_table_update(
+                &viewport->scanline_table,
+                viewport->width,
+                viewport->height,
+                block_width,
+                block_height,
+                perspective,
+                vtexture ? vtexture->mipmap_count : texture->mipmap_count
+            )) {
+                fprintf(stderr, "Cannot allocate scanline table\n");
+                exit(1);
+            }
 
-                if (0
-                    || !(0 <= tx.x && tx.x < texture->mipmaps[0].image->width)
-                    || !(0 <= tx.y && tx.y < texture->mipmaps[0].image->height)
-                ) {
-                    tx.x = wrap_repeat(
-                        tx.x,
-                        maps[current_map].padding_box_pos.x,
-                        maps[current_map].padding_box_pos.x + maps[current_map].padding_box_size - 1
-                    );
+            if (viewport_count == 1) {
+                viewport_snap_camera(viewport, &render_cameras[CAMERA_PLAYER1]);
+            }
+        }
 
-                    tx.y = wrap_repeat(
-                        tx.y,
-                        maps[current_map].padding_box_pos.y,
-                        maps[current_map].padding_box_pos.y + maps[current_map].padding_box_size - 1
-                    );
-                }
+        render_job_t job = {
+            viewports,
+            viewport_count,
+            &sampler,
+            rendered_frame_count,
+            &framebuffer,
+            0
+        };
+
+        {
+            TRACE_ZONE("render viewports");
+            render_pool_run(&render_pool, &job);
+        }
 
-                tx.x /= mipmap->ratio;
-                tx.y /= mipmap->ratio;
+        /* composited before anything is drawn or exported, in the top right corner */
+        const int minimap_was_shown = minimap_shown;
+        minimap_shown = 0;
+        if (1
+            && minimap_enabled
+            && texture
+            && colors
+            && scr_w >= 2 * MINIMAP_WIDTH
+            && scr_h >= 2 * MINIMAP_HEIGHT
+        ) {
+            TRACE_ZONE("minimap");
 
-                const uint8_t color_idx = mipmap->image->data[(int)tx.y * mipmap->image->width + (int)tx.x];
-                if ((color_idx + rendered_frame_count) % 13) {
+            /* rear view is the same camera */
+            minimap_marker_t markers[MINIMAP_MAX_MARKERS];
+            size_t marker_count = 0;
+            for (i = 0; i < viewport_count && marker_count < MINIMAP_MAX_MARKERS; i++) {
+                if (viewports[i].orientation_offset != 0) {
                     continue;
                 }
 
-                renderers[current_renderer].draw(
-                    j,
-                    i,
-                    mipmap->image->colors,
-                    color_idx
-                );
+                markers[marker_count].position.x = viewports[i].camera->position.x + viewports[i].scanline_table.center.x;
+                markers[marker_count].position.y = viewports[i].camera->position.y + viewports[i].scanline_table.center.y;
+                markers[marker_count].orientation = viewports[i].camera->orientation;
+                marker_count++;
+            }
+
+            minimap_shown = minimap_update(&minimap, texture, block_width, block_height, markers, marker_count);
+        }
 
-                rendered_pixel_count++;
+        if (minimap_shown) {
+            const size_t x = (scr_w - MINIMAP_WIDTH - 1) * block_width;
+            const size_t y = 1 * block_height;
+            if (0
+                || !minimap_was_shown
+                || minimap.overlay.x != x
+                || minimap.overlay.y != y
+                || minimap_renderer != current_renderer
+            ) {
+                overlay_invalidate_all(&minimap.overlay);
             }
+
+            minimap.overlay.x = x;
+            minimap.overlay.y = y;
+            minimap_renderer = current_renderer;
+            overlay_composite(&minimap.overlay, &framebuffer);
         }
 
-        refresh();
+        uint8_t (*draw_colors)[4] = colors;
+        if (cycling) {
+            const size_t phase = capture_ns / cycle_period_ns;
+            if (phase != cycle_phase) {
+                cycle_phase = phase;
+                palette_cycle(colors, cycle_indices, cycle_count, phase, cycled_colors);
+                renderer_context.renderer->init(&renderer_context, cycled_colors);
+            }
 
-        rendered_frame_count++;
+            draw_colors = cycled_colors;
+        }
 
-        renderers[current_renderer].draw(0, i, texture->mipmaps[0].image->colors, 5);
-        printw(
-            "move spd: %6.1f, turn spd: %4.1f, colors: %3lu, mipmaps: %lu, renderer: %10s, map: %s\n",
-            accelerator_velocity(&move_accelerator),
-            accelerator_velocity(&turn_accelerator),
-            color_count,
-            mipmap_count,
-            renderers[current_renderer].name,
-            strrchr(maps[current_map].file_name, '/') + 1
-        );
-    }
+        /*
+         * Translation-only motion without perspective shifts the image by whole cells:
+         * the terminal scrolls what it shows and only exposed cells are drawn in full.
+         */
+        const int shift_enabled = viewport_count == 1 && !perspective && !scanline_effect && draw_colors;
+        if (shift_enabled) {
+            long dx, dy;
+            if (1
+                && shift_valid
+                && shift_width == scr_w
+                && shift_height == scr_h
+                && shift_renderer == current_renderer
+                && viewport_cell_shift(&viewports[0], &shift_camera, &dx, &dy)
+                && (dx || dy)
+                && labs(dx) < scr_w
+                && labs(dy) < scr_h
+            ) {
+                TRACE_ZONE("shift");
+                renderer_shift(&renderer_context, 0, 0, scr_w, scr_h, dx, dy);
+                pending_scroll += dy;
+                overlay_invalidate_all(&minimap.overlay);
 
-    terminate_ncurses();
-    texture_destroy(texture);
+                if (dy) {
+                    renderer_draw_rect(&renderer_context, &framebuffer, draw_colors, 0, dy > 0 ? scr_h - dy : 0, scr_w, labs(dy));
+                }
 
-    return 0;
-}
+                if (dx) {
+                    renderer_draw_rect(&renderer_context, &framebuffer, draw_colors, dx > 0 ? scr_w - dx : 0, 0, labs(dx), scr_h);
+                }
 
-static void terminate_ncurses(void)
-{
-    static int called = 0;
-    if (called) {
-        return;
-    }
+                /* the minimap scrolled away with the image, the cells it covered are drawn again */
+                if (minimap_was_shown) {
+                    long left = (long)(minimap.overlay.x / block_width) - dx;
+                    long top = (long)(minimap.overlay.y / block_height) - dy;
+                    long right = left + MINIMAP_WIDTH;
+                    long bottom = top + MINIMAP_HEIGHT;
+                    left = left > 0 ? left : 0;
+                    top = top > 0 ? top : 0;
+                    right = right < scr_w ? right : scr_w;
+                    bottom = bottom < scr_h ? bottom : scr_h;
+                    if (left < right && top < bottom) {
+                        renderer_draw_rect(&renderer_context, &framebuffer, draw_colors, left, top, right - left, bottom - top);
+                    }
+                }
+            }
 
-    called = 1;
+            shift_camera = render_cameras[CAMERA_PLAYER1];
+            shift_valid = 1;
+            shift_width = scr_w;
+            shift_height = scr_h;
+            shift_renderer = current_renderer;
+        } else {
+            shift_valid = 0;
+        }
 
-    restore_colors();
-    standend();
-    endwin();
-}
+        /* the screen was resized or redrawn since, scrolled rows would not match */
+        if (!shift_valid || labs(pending_scroll) >= scr_h) {
+            pending_scroll = 0;
+        }
 
-static void restore_colors(void)
-{
-    static int init = 0;
-    static short colors[256][3];
-    static short pairs[256][2];
+        if (export_name && draw_colors) {
+            frame_export_publish(&frame_export, &framebuffer, draw_colors, rendered_frame_count, capture_ns);
+        }
 
-    size_t max_colors = sizeof(colors) / sizeof(colors[0]);
-    if (max_colors > COLORS) {
-        max_colors = COLORS;
-    }
+        if (draw_colors) {
+            TRACE_ZONE("draw");
+            if (settling) {
+                renderer_draw_rect(&renderer_context, &framebuffer, draw_colors, 0, 0, scr_w, scr_h);
+            } else {
+                renderer_draw_framebuffer(&renderer_context, &framebuffer, draw_colors, rendered_frame_count);
+            }
 
-    size_t max_pairs = sizeof(pairs) / sizeof(pairs[0]);
-    if (max_pairs > COLOR_PAIRS) {
-        max_pairs = COLOR_PAIRS;
-    }
+            if (minimap_shown) {
+                overlay_draw_dirty(&minimap.overlay, &renderer_context, &framebuffer, draw_colors);
+            } else if (minimap_was_shown) {
+                /* what was under it, without waiting for interleaving */
+                overlay_invalidate_all(&minimap.overlay);
+                overlay_draw_dirty(&minimap.overlay, &renderer_context, &framebuffer, draw_colors);
+            }
+        }
 
-    if (!init) {
-        init = 1;
+        wnoutrefresh(stdscr);
 
-        size_t i;
-        for (i = 0; i < max_colors; i++) {
-            color_content(
-                i,
-                &colors[i][0],
-                &colors[i][1],
-                &colors[i][2]
-            );
+        if (output_ready(&output)) {
+            TRACE_ZONE("refresh");
+            output_frame_begin(&output);
+            if (pending_scroll) {
+                output_scroll(0, scr_h - 1, pending_scroll);
+                pending_scroll = 0;
+            }
+
+            doupdate();
+            output_frame_end(&output);
+            output_submit(&output, capture_ns, predicted_latency_ns);
+            frame_skipped = 0;
+        } else {
+            output.skipped_count++;
+            frame_skipped = 1;
         }
 
-        for (i = 0; i < max_pairs; i++) {
-            pair_content(
-                i,
-                &pairs[i][0],
-                &pairs[i][1]
-            );
+        if (vtexture) {
+            vtexture_update(vtexture);
+
+            for (i = 0; i < viewport_count; i++) {
+                const viewport_t * const viewport = &viewports[i];
+                const float orientation = viewport->camera->orientation + viewport->orientation_offset;
+                const vec2_t position = {
+                    viewport->camera->position.x + viewport->scanline_table.center.x,
+                    viewport->camera->position.y + viewport->scanline_table.center.y
+                };
+
+                const vec2_t direction = {sinf(orientation), -cosf(orientation)};
+                vtexture_prefetch(vtexture, position, direction);
+            }
         }
 
-        return;
-    }
+        rendered_frame_count++;
 
-    size_t i;
-    for (i = 0; i < max_colors; i++) {
-        init_color(
-            i,
-            colors[i][0],
-            colors[i][1],
-            colors[i][2]
-        );
-    }
+        if (draw_colors) {
+            renderer_context.renderer->draw(&renderer_context, 0, scr_h, draw_colors, 5);
+        } else {
+            move(scr_h, 0);
+        }
 
-    for (i = 0; i < max_pairs; i++) {
-        init_pair(
-            i,
-            pairs[i][0],
-            pairs[i][1]
+        printw(
+            "move spd: %6.1f, turn spd: %4.1f, colors: %3lu, mipmaps: %lu, renderer: %10s, view: %9s, map: %s",
+            accelerator_velocity(&camera->move_accelerator),
+            accelerator_velocity(&camera->turn_accelerator),
+            vtexture ? 256 : color_count,
+            vtexture ? vtexture->mipmap_count : mipmap_count,
+            renderer_context.renderer->name,
+            layouts[current_layout],
+            vtexture ? vtexture_file_name : strrchr(maps[current_map].file_name, '/') + 1
         );
-    }
 
-    attrset(A_NORMAL);
-}
+        if (vtexture) {
+            printw(
+                ", pages: %3lu/%d, loads: %lu",
+                vtexture->resident_count,
+                VTEXTURE_CACHE_PAGES,
+                vtexture->load_count
+            );
+        }
 
-static image_t * image_create(const char * file_name)
-{
-    /*
-     * Only indexed BMP v3 are supported, without RLE compression.
-     * Use this ImageMagick command to convert an image to this format:
-     *   convert in.png -colors 256 -compress none BMP3:out.bmp
-     */
+        printw(
+            ", lat: %3.0fms, pred: %3s (err: %3.0fms), palette: %lu",
+            latency_ns / 1e6,
+            latency_compensation ? "on" : "off",
+            latency_error_ns / 1e6,
+            palette_shadow.upload_count
+        );
 
-    image_t * image = NULL;
-    FILE * fp = NULL;
+        if (texture && texture_ready_count(texture) < texture->mipmap_count) {
+            printw(", loading: %lu/%lu", texture_ready_count(texture), texture->mipmap_count);
+        }
 
-    image = malloc(sizeof(*image));
-    if (!image) {
-        goto error;
+        printw("\n");
     }
 
-    image->data = NULL;
+    terminate_ncurses();
+    render_pool_destroy(&render_pool);
+    framebuffer_destroy(&framebuffer);
+    minimap_destroy(&minimap);
 
-    fp = fopen(file_name, "rb");
-    if (!fp) {
-        goto error;
+    for (i = 0; i < sizeof(viewports) / sizeof(viewports[0]); i++) {
+        scanline_table_destroy(&viewports[i].scanline_table);
     }
 
-    char header[54];
-    size_t read;
-    if ((read = fread(header, sizeof(header), 1, fp)) != 1) {
-        goto error;
+    if (vtexture) {
+        vtexture_close(vtexture);
+    } else {
+        texture_destroy(texture);
     }
 
-    /* little endian only */
-    image->width = *(uint32_t*)&header[18];
-    image->height = *(uint32_t*)&header[22];
-
-    image->data = malloc(image->width * image->height);
-    if (!image->data) {
-        goto error;
-    }
+    frame_export_close(&frame_export);
 
-    if (fread(image->colors, sizeof(image->colors), 1, fp) != 1) {
-        goto error;
-    }
+    return 0;
+}
 
-    size_t i;
-    /* BGRA -> RGBA */
+/* blue dominant colors (among used ones, when known) sorted by luminance, returns their count */
+static size_t palette_water_indices(uint8_t colors[][4], const uint8_t * used_colors, uint8_t * indices)
+{
+    size_t count = 0;
+    size_t i, j;
     for (i = 0; i < 256; i++) {
-        image->colors[i][0] ^= image->colors[i][2];
-        image->colors[i][2] ^= image->colors[i][0];
-        image->colors[i][0] ^= image->colors[i][2];
-    }
-
-    const size_t line_padding = image->width % 4;
-    for (i = 0; i < image->height; i++) {
-        if (
-            fread(image->data + (image->height - i - 1) * image->width, image->width, 1, fp) != 1
+        const uint8_t * const color = colors[i];
+        if (0
+            || (used_colors && !used_colors[i])
+            || color[2] < 64
+            || color[2] < color[0] + 32
+            || color[2] < color[1]
         ) {
-            goto error;
+            continue;
         }
 
-        if (line_padding > 0) {
-            fseek(fp, line_padding, SEEK_CUR);
+        /* insertion sort, 256 entries at most */
+        const int lum = color[0] + color[1] + color[2];
+        for (j = count; j > 0; j--) {
+            const uint8_t * const other = colors[indices[j - 1]];
+            if (other[0] + other[1] + other[2] <= lum) {
+                break;
+            }
+
+            indices[j] = indices[j - 1];
         }
-    }
 
-    fclose(fp);
+        indices[j] = i;
+        count++;
+    }
 
-    return image;
+    return count;
+}
 
-error:
-    if (image) {
-        free(image->data);
-    }
+static void minimap_init(minimap_t * minimap)
+{
+    overlay_init(&minimap->overlay);
+    minimap->background = NULL;
+    minimap->block_width = 0;
+    minimap->block_height = 0;
+    minimap_reset(minimap);
+}
 
-    free(image);
+/* the texture changed, the next update rebuilds everything */
+static void minimap_reset(minimap_t * minimap)
+{
+    minimap->level = NULL;
+    minimap->cell_count = 0;
+}
 
-    if (fp) {
-        fclose(fp);
+/* fills a cell with a color, or the map when NULL */
+static void minimap_fill_cell(minimap_t * minimap, const long cell[2], const uint8_t * color)
+{
+    framebuffer_t * const buffer = &minimap->overlay.buffer;
+    const size_t x0 = cell[0] * minimap->block_width;
+    const size_t y0 = cell[1] * minimap->block_height;
+
+    size_t x, y;
+    for (y = y0; y < y0 + minimap->block_height; y++) {
+        for (x = x0; x < x0 + minimap->block_width; x++) {
+            buffer->data[y * buffer->width + x] = color ? *color : minimap->background[y * buffer->width + x];
+        }
     }
 
-    return NULL;
+    overlay_invalidate(&minimap->overlay, x0, y0, minimap->block_width, minimap->block_height);
 }
 
-static void image_quantize(image_t * image, size_t max_color_count)
-{
-    static uint32_t stats[256];
+/* returns 0 when there is nothing to show yet */
+static int minimap_update(
+    minimap_t * minimap,
+    const texture_t * texture,
+    size_t block_width,
+    size_t block_height,
+    const minimap_marker_t * markers,
+    size_t marker_count
+) {
+    const texture_mimap_t * const level = texture_level(texture, texture->mipmap_count - 1);
+    if (!level) {
+        return 0;
+    }
 
-    while (1) {
-        size_t i;
+    const size_t width = MINIMAP_WIDTH * block_width;
+    const size_t height = MINIMAP_HEIGHT * block_height;
+    size_t i, x, y;
 
-        for (i = 0; i < 256; i++) {
-            stats[i] = 0;
+    if (0
+        || level != minimap->level
+        || block_width != minimap->block_width
+        || block_height != minimap->block_height
+    ) {
+        uint8_t * const background = realloc(minimap->background, width * height);
+        if (!background) {
+            return 0;
         }
 
-        for (i = 0; i < image->width * image->height; i++) {
-            stats[image->data[i]]++;
+        minimap->background = background;
+        if (!overlay_resize(&minimap->overlay, width, height)) {
+            return 0;
         }
 
-        size_t color_count = 0;
-        for (i = 0; i < 256; i++) {
-            if (stats[i] > 0) {
-                color_count++;
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x++) {
+                background[y * width + x] = texture_texel(
+                    texture,
+                    level,
+                    (x + 0.5f) * level->width / width,
+                    (y + 0.5f) * level->height / height
+                );
             }
         }
 
-        if (color_count < 2 || color_count <= max_color_count) {
-            break;
-        }
-
-        struct {
-            uint8_t a;
-            uint8_t b;
-            float dist;
-        } nearest = {0, 0, FLT_MAX};
+        memcpy(minimap->overlay.buffer.data, background, width * height);
+        overlay_invalidate_all(&minimap->overlay);
 
+        /* brightest and darkest colors of the map */
+        int min_lum = 3 * 256;
+        int max_lum = -1;
         for (i = 0; i < 256; i++) {
-            if (stats[i] == 0) {
+            if (!texture->used_colors[i]) {
                 continue;
             }
 
-            size_t j;
-            for (j = 0; j < 256; j++) {
-                if (i >= j) {
-                    continue;
-                }
-
-                if (stats[j] == 0) {
-                    continue;
-                }
+            const int lum = texture->colors[i][0] + texture->colors[i][1] + texture->colors[i][2];
 
-                const float dist = sqrtf(0
-                    + powf(image->colors[i][0] - image->colors[j][0], 2)
-                    + powf(image->colors[i][1] - image->colors[j][1], 2)
-                    + powf(image->colors[i][2] - image->colors[j][2], 2)
-                );
+            if (lum > max_lum) {
+                max_lum = lum;
+                minimap->marker_color = i;
+            }
 
-                if (nearest.dist > dist) {
-                    nearest.dist = dist;
-                    nearest.a = i;
-                    nearest.b = j;
-                }
+            if (lum < min_lum) {
+                min_lum = lum;
+                minimap->heading_color = i;
             }
         }
 
-        for (i = 0; i < 3; i++) {
-            image->colors[nearest.a][i] = (0
-                + image->colors[nearest.a][i] * stats[nearest.a]
-                + image->colors[nearest.b][i] * stats[nearest.b]
-            ) / (0
-                + stats[nearest.a]
-                + stats[nearest.b]
-            );
-        }
+        minimap->level = level;
+        minimap->block_width = block_width;
+        minimap->block_height = block_height;
+        minimap->cell_count = 0;
+    }
+
+    /* heading cell then marker cell, cells are about twice as high as wide */
+    long cells[MINIMAP_MAX_MARKERS * 2][2];
+    size_t cell_count = 0;
+    for (i = 0; i < marker_count && i < MINIMAP_MAX_MARKERS; i++) {
+        long cx = wrap_repeat(markers[i].position.x, 0, texture->width) * MINIMAP_WIDTH / texture->width;
+        long cy = wrap_repeat(markers[i].position.y, 0, texture->height) * MINIMAP_HEIGHT / texture->height;
+        cx = cx < MINIMAP_WIDTH ? cx : MINIMAP_WIDTH - 1;
+        cy = cy < MINIMAP_HEIGHT ? cy : MINIMAP_HEIGHT - 1;
+
+        long hx = cx + lroundf(2 * sinf(markers[i].orientation));
+        long hy = cy - lroundf(cosf(markers[i].orientation));
+        hx = hx < 0 ? 0 : hx < MINIMAP_WIDTH ? hx : MINIMAP_WIDTH - 1;
+        hy = hy < 0 ? 0 : hy < MINIMAP_HEIGHT ? hy : MINIMAP_HEIGHT - 1;
+
+        cells[cell_count][0] = hx;
+        cells[cell_count][1] = hy;
+        cell_count++;
+
+        cells[cell_count][0] = cx;
+        cells[cell_count][1] = cy;
+        cell_count++;
+    }
+
+    if (cell_count == minimap->cell_count && memcmp(cells, minimap->cells, cell_count * sizeof(cells[0])) == 0) {
+        return 1;
+    }
+
+    for (i = 0; i < minimap->cell_count; i++) {
+        minimap_fill_cell(minimap, minimap->cells[i], NULL);
+    }
+
+    for (i = 0; i < cell_count; i++) {
+        minimap_fill_cell(minimap, cells[i], i % 2 ? &minimap->marker_color : &minimap->heading_color);
+    }
+
+    memcpy(minimap->cells, cells, cell_count * sizeof(cells[0]));
+    minimap->cell_count = cell_count;
+
+    return 1;
+}
+
+static void minimap_destroy(minimap_t * minimap)
+{
+    overlay_destroy(&minimap->overlay);
+    free(minimap->background);
+    minimap_init(minimap);
+}
+
+static void terminate_ncurses(void)
+{
+    static int called = 0;
+    if (called) {
+        return;
+    }
+
+    called = 1;
+
+    if (active_output) {
+        output_stop(active_output);
+        active_output = NULL;
+    }
+
+    palette_backup_restore(&palette_backup, &palette_shadow);
+    standend();
+    endwin();
+}
+
+static int kb_event_get(kb_state_t * state)
+{
+    const size_t pressed_keys_size = sizeof(state->pressed_keys) / sizeof(state->pressed_keys[0]);
+
+    const size_t current_time_ms = current_time_ns() / (1000 * 1000);
+
+    const int c = getch();
+
+    if (c == ERR) {
+        goto release_next;
+    }
+
+    if (c >= pressed_keys_size) {
+        goto release_next;
+    }
+
+    state->pressed_keys[c].last_time_ms = current_time_ms;
+    state->pressed_keys[c].count++;
+
+    if (state->pressed_keys[c].count > 1) {
+        goto release_next;
+    }
+
+    printw("press = %d\n", c);
+
+    return c;
 
-        for (i = 0; i < image->width * image->height; i++) {
-            if (image->data[i] == nearest.b) {
-                image->data[i] = nearest.a;
+release_next:
+    {
+        size_t i;
+        for (i = 0; i < pressed_keys_size; i++) {
+            if (state->pressed_keys[i].count == 0) {
+                continue;
+            }
+
+            const size_t last_time_delay_ms = current_time_ms - state->pressed_keys[i].last_time_ms;
+            if (
+                (state->pressed_keys[i].count == 1 && last_time_delay_ms > 600)
+                || (state->pressed_keys[i].count > 1 && last_time_delay_ms > 120)
+            ) {
+                state->pressed_keys[i].count = 0;
+
+                printw("release = %d\n", i);
+
+                return i | KB_EVENT_RELEASE;
             }
         }
     }
+
+    return ERR;
 }
 
-static image_t * image_create_downsized_copy(const image_t * image, size_t w, size_t h)
+/* whether a key is still considered pressed, its release is pending */
+static int kb_keys_held(const kb_state_t * state)
 {
-    if (0
-        || w >= image->width || image->width % w
-        || h >= image->height || image->height % h
-    ) {
-        fprintf(stderr, "Invalid downsizing parameters\n");
-        exit(1);
+    size_t i;
+    for (i = 0; i < sizeof(state->pressed_keys) / sizeof(state->pressed_keys[0]); i++) {
+        if (state->pressed_keys[i].count) {
+            return 1;
+        }
     }
 
-    image_t * new_image = malloc(sizeof(*image));
-    if (!new_image) {
-        goto error;
+    return 0;
+}
+
+static void idle_sigwinch(int sig)
+{
+    /* only interrupts idle_wait(), the size is read by output_sync_size() */
+    (void) sig;
+}
+
+static void idle_signals_init(sigset_t * wait_mask)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = idle_sigwinch;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGWINCH, &action, NULL);
+
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGWINCH);
+    pthread_sigmask(SIG_BLOCK, &blocked, wait_mask);
+    sigdelset(wait_mask, SIGWINCH);
+}
+
+/* blocks until input, a resize or the timeout (none when negative) */
+static void idle_wait(int timeout_ms, const sigset_t * wait_mask)
+{
+    TRACE_ZONE("idle");
+
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    const struct timespec timeout = {timeout_ms / 1000, (long) (timeout_ms % 1000) * 1000 * 1000};
+    ppoll(&pfd, 1, timeout_ms < 0 ? NULL : &timeout, wait_mask);
+}
+
+static void output_frame_presented(output_t * output, size_t frame)
+{
+    const size_t idx = frame % OUTPUT_MAX_FRAMES;
+    const float latency_ns = current_time_ns() - output->frame_capture_ns[idx];
+    const float error_ns = fabsf(latency_ns - output->frame_predicted_latency_ns[idx]);
+
+    if (frame == 0) {
+        output->latency_ns = latency_ns;
+        output->latency_error_ns = error_ns;
+
+        return;
     }
 
-    new_image->data = malloc(w * h);
-    if (!new_image->data) {
-        goto error;
+    output->latency_ns += 0.1f * (latency_ns - output->latency_ns);
+    output->latency_error_ns += 0.1f * (error_ns - output->latency_error_ns);
+}
+
+/* to be called with the mutex held */
+static int output_frame_complete(const output_t * output)
+{
+    return 1
+        && output->presented_count < output->submitted_count
+        && output->frame_ends[output->presented_count % OUTPUT_MAX_FRAMES] <= output->written_total
+    ;
+}
+
+/* to be called with the mutex held */
+static void output_present(output_t * output)
+{
+    while (output_frame_complete(output)) {
+        output_frame_presented(output, output->presented_count);
+        output->presented_count++;
     }
+}
 
-    new_image->width = w;
-    new_image->height = h;
+static void * output_writer(void * arg)
+{
+    output_t * const output = arg;
 
-    memcpy(new_image->colors, image->colors, sizeof(new_image->colors));
+    TRACE_THREAD_NAME("output writer");
 
-    const size_t hr = image->height / new_image->height;
-    const size_t wr = image->width / new_image->width;
-    size_t i;
-    for (i = 0; i < new_image->height; i++) {
-        size_t j;
-        for (j = 0; j < new_image->width; j++) {
-            uint16_t stats[256] = {0};
-            size_t k;
-            for (k = 0; k < hr; k++) {
-                size_t l;
-                for (l = 0; l < wr; l++) {
-                    stats[image->data[(i * hr + k) * image->width + (j * wr + l)]]++;
-                }
+    char * const buffer = output->buffer;
+    while (1) {
+        struct pollfd pfd = {output->pipe_fd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
             }
 
-            size_t avg[3] = {0};
-            for (k = 0; k < 256; k++) {
-                if (stats[k] == 0) {
-                    continue;
-                }
+            break;
+        }
 
-                avg[0] += image->colors[k][0] * stats[k];
-                avg[1] += image->colors[k][1] * stats[k];
-                avg[2] += image->colors[k][2] * stats[k];
+        /* read_total must not lag behind the pipe content, see output_submit() */
+        pthread_mutex_lock(&output->mutex);
+        const ssize_t n = read(output->pipe_fd, buffer, OUTPUT_BUFFER_SIZE);
+        if (n > 0) {
+            output->read_total += n;
+        }
+
+        pthread_mutex_unlock(&output->mutex);
+
+        if (n == 0) {
+            /* write end closed by output_stop() */
+            break;
+        }
+
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
             }
 
-            avg[0] /= hr * wr;
-            avg[1] /= hr * wr;
-            avg[2] /= hr * wr;
-
-            struct {
-                uint8_t idx;
-                size_t dist;
-            } nearest = {0, SIZE_MAX};
-
-            for (k = 0; k < 256; k++) {
-                /*
-                 * This is not the vector length, we just need a fast approximation of relative distance.
-                 */
-                const size_t dist = 0
-                    + abs(avg[0] - image->colors[k][0])
-                    + abs(avg[1] - image->colors[k][1])
-                    + abs(avg[2] - image->colors[k][2])
-                ;
-
-                if (nearest.dist > dist) {
-                    nearest.dist = dist;
-                    nearest.idx = k;
+            break;
+        }
+
+        TRACE_ZONE("write");
+
+        ssize_t written = 0;
+        while (written < n) {
+            const ssize_t w = write(output->tty_fd, buffer + written, n - written);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
                 }
+
+                break;
             }
 
-            new_image->data[i * new_image->width + j] = nearest.idx;
+            written += w;
         }
+
+        pthread_mutex_lock(&output->mutex);
+        output->written_total += n;
+        const int frame_complete = output_frame_complete(output);
+        pthread_mutex_unlock(&output->mutex);
+
+        if (!frame_complete) {
+            continue;
+        }
+
+        /* a frame is presented once the terminal has consumed it */
+        tcdrain(output->tty_fd);
+
+        pthread_mutex_lock(&output->mutex);
+        output_present(output);
+        pthread_mutex_unlock(&output->mutex);
+    }
+
+    return NULL;
+}
+
+/*
+ * To be called after initscr(): the terminal stays the controlling one for
+ * ncurses (tty modes), only the output file descriptor is swapped.
+ * Returns 0 when falling back to synchronous output.
+ */
+static int output_start(output_t * output, int sync_update)
+{
+    output->active = 0;
+    output->sync_update = sync_update;
+    output->tty_fd = -1;
+    output->pipe_fd = -1;
+    output->read_total = 0;
+    output->written_total = 0;
+    output->submitted_count = 0;
+    output->presented_count = 0;
+    output->skipped_count = 0;
+    output->latency_ns = 0;
+    output->latency_error_ns = 0;
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return 0;
     }
 
-    return new_image;
+    /* room for a few full frames, so that ncurses rarely blocks on the writer */
+#ifdef F_SETPIPE_SZ
+    fcntl(fds[1], F_SETPIPE_SZ, 1024 * 1024);
+#endif
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    fflush(stdout);
+
+    output->tty_fd = dup(STDOUT_FILENO);
+    if (output->tty_fd < 0) {
+        goto error;
+    }
+
+    output->pipe_fd = fds[0];
+    pthread_mutex_init(&output->mutex, NULL);
+
+    if (pthread_create(&output->thread, NULL, output_writer, output) != 0) {
+        pthread_mutex_destroy(&output->mutex);
+        goto error;
+    }
+
+    if (dup2(fds[1], STDOUT_FILENO) < 0) {
+        /* the writer exits on EOF */
+        close(fds[1]);
+        pthread_join(output->thread, NULL);
+        pthread_mutex_destroy(&output->mutex);
+        fds[1] = -1;
+        goto error;
+    }
+
+    close(fds[1]);
+    output->active = 1;
+
+    return 1;
 
 error:
-    if (new_image) {
-        image_destroy(new_image);
+    close(fds[0]);
+    if (fds[1] >= 0) {
+        close(fds[1]);
     }
 
-    return NULL;
+    if (output->tty_fd >= 0) {
+        close(output->tty_fd);
+    }
+
+    output->tty_fd = -1;
+    output->pipe_fd = -1;
+
+    return 0;
 }
 
-static void image_destroy(image_t * image)
+/* flushes every pending byte and gives the terminal back to ncurses */
+static void output_stop(output_t * output)
 {
-    free(image->data);
-    free(image);
+    if (!output->active) {
+        return;
+    }
+
+    fflush(stdout);
+
+    /* closes the last pipe write end */
+    dup2(output->tty_fd, STDOUT_FILENO);
+    pthread_join(output->thread, NULL);
+    pthread_mutex_destroy(&output->mutex);
+
+    close(output->pipe_fd);
+    close(output->tty_fd);
+    output->pipe_fd = -1;
+    output->tty_fd = -1;
+    output->active = 0;
 }
 
-static texture_t * texture_create(const char * file_name, size_t max_color_count, size_t mipmap_count)
+/* whether a new frame can be encoded, i.e. the previous one has been written */
+static int output_ready(output_t * output)
 {
-    texture_t * texture = malloc(sizeof(*texture));
-    if (!texture) {
-        return NULL;
+    if (!output->active) {
+        return 1;
     }
 
-    texture->mipmap_count = 0;
+    pthread_mutex_lock(&output->mutex);
+    const int ready = output->presented_count == output->submitted_count;
+    pthread_mutex_unlock(&output->mutex);
+
+    return ready;
+}
 
-    const size_t max_mipmap_count = sizeof(texture->mipmaps) / sizeof(texture->mipmaps[0]);
-    
-    if (mipmap_count == 0) {
-        mipmap_count = 1;
+/*
+ * Queries support for synchronized updates (DEC private mode 2026) with
+ * DECRQM, followed by a primary device attributes request which every
+ * terminal answers, so that unsupporting terminals do not cost a timeout.
+ */
+static int output_detect_sync_update(void)
+{
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
+        return 0;
     }
 
-    if (mipmap_count > max_mipmap_count) {
-        mipmap_count = max_mipmap_count;
+    struct termios saved;
+    if (tcgetattr(STDIN_FILENO, &saved) != 0) {
+        return 0;
     }
 
-    texture->mipmaps[0].ratio = 1;
-    texture->mipmaps[0].image = image_create(file_name);
-    if (!texture->mipmaps[0].image) {
-        goto error;
+    struct termios raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+    const char query[] = "\033[?2026$p\033[c";
+    if (write(STDOUT_FILENO, query, sizeof(query) - 1) != sizeof(query) - 1) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+
+        return 0;
     }
 
-    texture->mipmap_count++;
+    /* empty when nothing is read before the deadline */
+    char response[256] = "";
+    size_t size = 0;
+    const size_t deadline_ns = current_time_ns() + 500 * 1000 * 1000;
 
-    image_quantize(texture->mipmaps[0].image, max_color_count);
+    /* until the device attributes response: CSI ? ... c */
+    while (size < sizeof(response) - 1) {
+        const size_t now_ns = current_time_ns();
+        if (now_ns >= deadline_ns) {
+            break;
+        }
 
-    size_t i;
-    for (i = 1; i < mipmap_count; i++) {
-        texture->mipmaps[i].ratio = 2 * texture->mipmaps[i - 1].ratio;
-        texture->mipmaps[i].image = image_create_downsized_copy(
-            texture->mipmaps[0].image,
-            texture->mipmaps[0].image->width / texture->mipmaps[i].ratio,
-            texture->mipmaps[0].image->height / texture->mipmaps[i].ratio
-        );
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, (deadline_ns - now_ns) / (1000 * 1000) + 1) <= 0) {
+            break;
+        }
 
-        if (!texture->mipmaps[i].image) {
-            goto error;
+        const ssize_t n = read(STDIN_FILENO, response + size, sizeof(response) - 1 - size);
+        if (n <= 0) {
+            break;
         }
 
-        texture->mipmap_count++;
+        size += n;
+        response[size] = 0;
+
+        const char * p = response;
+        int done = 0;
+        while (!done && (p = strstr(p, "\033[?"))) {
+            p += 3;
+            p += strspn(p, "0123456789;");
+            done = *p == 'c';
+        }
+
+        if (done) {
+            break;
+        }
     }
 
-    return texture;
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved);
 
-error:
-    texture_destroy(texture);
+    /* DECRPM: CSI ? 2026 ; Ps $ y, with Ps 1 (set) or 2 (reset) when supported */
+    const char * const report = strstr(response, "\033[?2026;");
+    int mode = 0;
+    if (!report || sscanf(report, "\033[?2026;%d$y", &mode) != 1) {
+        return 0;
+    }
 
-    return NULL;
+    return mode == 1 || mode == 2;
 }
 
-static void texture_destroy(texture_t * texture)
+/*
+ * Begin/End Synchronized Update around a frame, so that the terminal
+ * presents it at once. Written directly to the output file descriptor:
+ * doupdate() flushes ncurses's own buffer before returning.
+ */
+static void output_write_sequence(const char * sequence)
 {
-    size_t i;
-    for (i = 0; i < texture->mipmap_count; i++) {
-        image_destroy(texture->mipmaps[i].image);
-    }
+    fflush(stdout);
 
-    free(texture);
+    size_t written = 0;
+    const size_t size = strlen(sequence);
+    while (written < size) {
+        const ssize_t n = write(STDOUT_FILENO, sequence + written, size - written);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+
+        written += n > 0 ? n : 0;
+    }
 }
 
-static void mat3_identity(mat3_t * m)
+static void output_frame_begin(const output_t * output)
 {
-    m->nums[0][0] = 1;
-    m->nums[0][1] = 0;
-    m->nums[0][2] = 0;
-
-    m->nums[1][0] = 0;
-    m->nums[1][1] = 1;
-    m->nums[1][2] = 0;
+    if (output->sync_update) {
+        output_write_sequence("\033[?2026h");
+    }
+}
 
-    m->nums[2][0] = 0;
-    m->nums[2][1] = 0;
-    m->nums[2][2] = 1;
+static void output_frame_end(const output_t * output)
+{
+    if (output->sync_update) {
+        output_write_sequence("\033[?2026l");
+    }
 }
 
-static void mat3_copy(mat3_t * a, const mat3_t * b)
+/*
+ * To be called right after doupdate(), which has flushed the frame to the
+ * pipe, with the time the frame state was captured at and the latency it
+ * has been predicted for.
+ */
+static void output_submit(output_t * output, size_t capture_ns, size_t predicted_latency_ns)
 {
-    memcpy(a, b, sizeof(*a));
+    const size_t idx = output->submitted_count % OUTPUT_MAX_FRAMES;
+
+    if (!output->active) {
+        /* already written */
+        output->frame_capture_ns[idx] = capture_ns;
+        output->frame_predicted_latency_ns[idx] = predicted_latency_ns;
+        output_frame_presented(output, output->submitted_count);
+        output->submitted_count++;
+        output->presented_count++;
+
+        return;
+    }
+
+    pthread_mutex_lock(&output->mutex);
+
+    int pending = 0;
+    ioctl(output->pipe_fd, FIONREAD, &pending);
+
+    output->frame_ends[idx] = output->read_total + pending;
+    output->frame_capture_ns[idx] = capture_ns;
+    output->frame_predicted_latency_ns[idx] = predicted_latency_ns;
+    output->submitted_count++;
+    output_present(output);
+
+    pthread_mutex_unlock(&output->mutex);
 }
 
-static void mat3_mult(mat3_t * a, const mat3_t * b)
+static void output_latency(output_t * output, float * latency_ns, float * latency_error_ns)
 {
-    size_t i, j;
-    mat3_t res;
-    for (i = 0; i < 3; i++) {
-        for (j = 0; j < 3; j++) {
-            res.nums[i][j] = 0
-                + a->nums[i][0] * b->nums[0][j]
-                + a->nums[i][1] * b->nums[1][j]
-                + a->nums[i][2] * b->nums[2][j]
-            ;
-        }
+    if (output->active) {
+        pthread_mutex_lock(&output->mutex);
     }
 
-    mat3_copy(a, &res);
+    *latency_ns = output->latency_ns;
+    *latency_error_ns = output->latency_error_ns;
+
+    if (output->active) {
+        pthread_mutex_unlock(&output->mutex);
+    }
 }
 
-static void mat3_translate(mat3_t * m, float x, float y)
+/*
+ * Scrolls terminal rows top to bottom by count rows (up when positive) with a scroll
+ * region, and curscr along, so that the next doupdate() only sends what differs from
+ * the scrolled content. Without terminal support nothing is done, doupdate() then
+ * sends the rows in full.
+ */
+static void output_scroll(int top, int bottom, long count)
 {
-    mat3_t transform_mat;
-    mat3_identity(&transform_mat);
-    transform_mat.nums[0][2] = x;
-    transform_mat.nums[1][2] = y;
+    char * const csr = tigetstr("csr");
+    char * const indn = tigetstr("indn");
+    char * const rin = tigetstr("rin");
+    if (0
+        || !csr || csr == (char *) -1
+        || !indn || indn == (char *) -1
+        || !rin || rin == (char *) -1
+    ) {
+        return;
+    }
+
+    /* rows scrolled in are cleared with the current background */
+    vidattr(A_NORMAL);
 
-    mat3_mult(m, &transform_mat);
+    putp(tiparm(csr, top, bottom));
+    putp(tiparm(count > 0 ? indn : rin, (int) labs(count)));
+    putp(tiparm(csr, 0, LINES - 1));
+
+    /* setting the scroll region homes the cursor */
+    mvcur(-1, -1, 0, 0);
+
+    /* terminfo output goes through stdio, doupdate() does not */
+    fflush(stdout);
+
+    wsetscrreg(curscr, top, bottom);
+    scrollok(curscr, TRUE);
+    wscrl(curscr, count);
+    scrollok(curscr, FALSE);
+    wsetscrreg(curscr, 0, LINES - 1);
 }
 
-static void mat3_scale(mat3_t * m, float x, float y)
+/*
+ * ncurses cannot query the terminal size through the pipe anymore, keep it
+ * in sync with the real terminal. SIGWINCH only wakes idle_wait() up.
+ */
+static void output_sync_size(const output_t * output)
 {
-    mat3_t transform_mat;
-    mat3_identity(&transform_mat);
-    transform_mat.nums[0][0] = x;
-    transform_mat.nums[1][1] = y;
+    struct winsize ws;
+    if (ioctl(output->active ? output->tty_fd : STDOUT_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_row == 0 || ws.ws_col == 0) {
+        return;
+    }
 
-    mat3_mult(m, &transform_mat);
+    if (ws.ws_row != LINES || ws.ws_col != COLS) {
+        resize_term(ws.ws_row, ws.ws_col);
+    }
 }
 
-static void mat3_rotate(mat3_t * m, float x)
+static void frame_export_init(frame_export_t * frame_export)
 {
-    const float cos = cosf(x);
-    const float sin = sinf(x);
-    mat3_t transform_mat;
-    mat3_identity(&transform_mat);
-    transform_mat.nums[0][0] = cos;
-    transform_mat.nums[0][1] = -sin;
-    transform_mat.nums[1][0] = sin;
-    transform_mat.nums[1][1] = cos;
-
-    mat3_mult(m, &transform_mat);
+    frame_export->name = NULL;
+    frame_export->mapping = MAP_FAILED;
+    frame_export->size = 0;
+    frame_export->slot_size = 0;
+    frame_export->published_count = 0;
+    frame_export->dropped_count = 0;
 }
 
-static void mat3_transform(const mat3_t * m, vec2_t * v)
+/*
+ * The ring is created exclusively: an existing one may belong to another instance
+ * which is still publishing, it is neither reused nor unlinked (errno is EEXIST).
+ */
+static int frame_export_open(frame_export_t * frame_export, const char * name)
 {
-    const float x = 0
-        + m->nums[0][0] * v->x
-        + m->nums[0][1] * v->y
-        + m->nums[0][2]
-    ;
+    frame_export->slot_size = (sizeof(frame_export_slot_t) + FRAME_EXPORT_CAPACITY + 63) / 64 * 64;
+    frame_export->size = FRAME_EXPORT_HEADER_SIZE + FRAME_EXPORT_SLOTS * frame_export->slot_size;
 
-    v->y = 0
-        + m->nums[1][0] * v->x
-        + m->nums[1][1] * v->y
-        + m->nums[1][2]
-    ;
+    const int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        return 0;
+    }
 
-    v->x = x;
+    frame_export->name = name;
+
+    if (ftruncate(fd, frame_export->size) != 0) {
+        close(fd);
+        goto error;
+    }
+
+    frame_export->mapping = mmap(NULL, frame_export->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (frame_export->mapping == MAP_FAILED) {
+        goto error;
+    }
+
+    /* readers check the magic last, once the layout is valid */
+    frame_export_header_t * const header = frame_export->mapping;
+    memset(frame_export->mapping, 0, frame_export->size);
+    header->slot_count = FRAME_EXPORT_SLOTS;
+    header->slot_capacity = FRAME_EXPORT_CAPACITY;
+    header->slot_size = frame_export->slot_size;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, FRAME_EXPORT_MAGIC, sizeof(header->magic));
+
+    return 1;
+
+error:
+    {
+        const int error = errno;
+        shm_unlink(name);
+        frame_export->name = NULL;
+        errno = error;
+    }
+
+    return 0;
 }
 
-static float wrap_repeat(float v, float min, float max)
-{
-    v -= min;
-    v = fmod(v, max - min);
-    v += min;
+static void frame_export_publish(
+    frame_export_t * frame_export,
+    const framebuffer_t * framebuffer,
+    uint8_t colors[][4],
+    size_t frame,
+    size_t timestamp_ns
+) {
+    TRACE_ZONE("frame export");
+
+    if (framebuffer->width * framebuffer->height > FRAME_EXPORT_CAPACITY) {
+        frame_export->dropped_count++;
+        return;
+    }
+
+    frame_export_header_t * const header = frame_export->mapping;
+    frame_export_slot_t * const slot = (frame_export_slot_t *) ((uint8_t *) frame_export->mapping
+        + FRAME_EXPORT_HEADER_SIZE
+        + frame % FRAME_EXPORT_SLOTS * frame_export->slot_size
+    );
+
+    /* seqlock write: odd sequence while the slot is inconsistent */
+    const uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 
-    if (v < min) {
-        v += max - min;
+    slot->frame = frame;
+    slot->timestamp_ns = timestamp_ns;
+    slot->width = framebuffer->width;
+    slot->height = framebuffer->height;
+    memcpy(slot->colors, colors, sizeof(slot->colors));
+    memcpy(slot->pixels, framebuffer->data, framebuffer->width * framebuffer->height);
+
+    __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->latest, frame + 1, __ATOMIC_RELEASE);
+
+    frame_export->published_count++;
+}
+
+static void frame_export_close(frame_export_t * frame_export)
+{
+    if (frame_export->mapping != MAP_FAILED) {
+        munmap(frame_export->mapping, frame_export->size);
+        frame_export->mapping = MAP_FAILED;
     }
 
-    return v;
+    if (frame_export->name) {
+        shm_unlink(frame_export->name);
+        frame_export->name = NULL;
+    }
 }
 
-static void renderer256_init(uint8_t colors[][4])
+static int perf_counters_open(perf_counters_t * counters)
 {
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[PERF_COUNTER_COUNT] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {
+            PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_L1D
+                | PERF_COUNT_HW_CACHE_OP_READ << 8
+                | PERF_COUNT_HW_CACHE_RESULT_MISS << 16
+        },
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    };
+
     size_t i;
-    for (i = 0; i < 256; i++) {
-        init_pair(i + 1, COLOR_BLACK, i);
+    for (i = 0; i < PERF_COUNTER_COUNT; i++) {
+        counters->fds[i] = -1;
     }
 
-    for (i = 0; i < 256; i++) {
-        init_color(
-            i,
-            (1000 * colors[i][0]) / 255,
-            (1000 * colors[i][1]) / 255,
-            (1000 * colors[i][2]) / 255
-        );
+    counters->error = 0;
+
+    /* user space only, which is what perf_event_paranoid 2 allows */
+    for (i = 0; i < PERF_COUNTER_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        counters->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : counters->fds[0], 0);
+        if (counters->fds[i] < 0 && i == 0) {
+            counters->error = errno;
+            return 0;
+        }
     }
+
+    return 1;
 }
 
-static void renderer256_draw(size_t x, size_t y, uint8_t colors[][4], uint8_t color_idx)
+/* values of unavailable counters are left to 0 */
+static int perf_counters_read(const perf_counters_t * counters, uint64_t values[PERF_COUNTER_COUNT])
 {
-    static int last_color_idx = -1;
+    uint64_t data[1 + PERF_COUNTER_COUNT];
+    size_t i, j;
 
-    if (last_color_idx != color_idx) {
-        last_color_idx = color_idx;
-        attron(COLOR_PAIR(color_idx + 1));
+    memset(values, 0, PERF_COUNTER_COUNT * sizeof(values[0]));
+
+    if (counters->fds[0] < 0 || read(counters->fds[0], data, sizeof(data)) < (ssize_t) sizeof(data[0])) {
+        return 0;
+    }
+
+    /* group members are read in creation order */
+    for (i = 0, j = 0; i < PERF_COUNTER_COUNT && j < data[0]; i++) {
+        if (counters->fds[i] >= 0) {
+            values[i] = data[1 + j++];
+        }
     }
 
-    mvaddch(y, x, ' ');
+    return 1;
 }
 
-static void renderer16_init(uint8_t colors[][4])
+static void perf_counters_close(perf_counters_t * counters)
 {
-    const int available_colors[] = {
-        COLOR_BLACK,   /* 000 -> 0 */
-        COLOR_BLUE,    /* 001 -> 1 */
-        COLOR_GREEN,   /* 010 -> 2 */
-        COLOR_CYAN,    /* 011 -> 3 */
-        COLOR_RED,     /* 100 -> 4 */
-        COLOR_MAGENTA, /* 101 -> 5 */
-        COLOR_YELLOW,  /* 110 -> 6 */
-        COLOR_WHITE,   /* 111 -> 7 */
-    };
+    size_t i;
+    for (i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (counters->fds[i] >= 0) {
+            close(counters->fds[i]);
+            counters->fds[i] = -1;
+        }
+    }
+}
 
-    const size_t available_color_count = sizeof(available_colors) / sizeof(available_colors[0]);
+static void bench_stage_begin(const perf_counters_t * counters, bench_stage_t * stage)
+{
+    perf_counters_read(counters, stage->start_counters);
+    stage->start_ns = current_time_ns();
+}
+
+static void bench_stage_end(const perf_counters_t * counters, bench_stage_t * stage)
+{
+    const size_t end_ns = current_time_ns();
+    uint64_t end_counters[PERF_COUNTER_COUNT];
+    perf_counters_read(counters, end_counters);
+
+    stage->ns += end_ns - stage->start_ns;
 
     size_t i;
-    for (i = 0; i < available_color_count; i++) {
-        init_pair(i + 1, available_colors[i], COLOR_BLACK);
+    for (i = 0; i < PERF_COUNTER_COUNT; i++) {
+        stage->counters[i] += end_counters[i] - stage->start_counters[i];
     }
 }
 
-static void renderer16_draw(size_t x, size_t y, uint8_t colors[][4], uint8_t color_idx)
+/*
+ * Renders frames of every map at several orientations with the camera moving forward,
+ * timing sampling (single threaded), renderer mapping into the ncurses screen and
+ * ncurses encoding into /dev/null, with hardware counters when available.
+ */
+static int bench_run(const map_t * maps, size_t map_count, size_t frame_count)
 {
-    const int available_colors[] = {
-        COLOR_BLACK,   /* 000 -> 0 */
-        COLOR_BLUE,    /* 001 -> 1 */
-        COLOR_GREEN,   /* 010 -> 2 */
-        COLOR_CYAN,    /* 011 -> 3 */
-        COLOR_RED,     /* 100 -> 4 */
-        COLOR_MAGENTA, /* 101 -> 5 */
-        COLOR_YELLOW,  /* 110 -> 6 */
-        COLOR_WHITE,   /* 111 -> 7 */
+    static const float orientations[] = {0, M_PI / 4, M_PI / 2, M_PI};
+    static const char * const stage_names[BENCH_STAGE_COUNT] = {"sampling", "mapping", "encoding"};
+    static const char * const counter_names[PERF_COUNTER_COUNT] = {
+        "cycles",
+        "instr",
+        "L1D miss",
+        "LLC miss",
+        "br miss",
     };
 
-    const size_t available_color_count = sizeof(available_colors) / sizeof(available_colors[0]);
+    const size_t orientation_count = sizeof(orientations) / sizeof(orientations[0]);
+    const vec2_t default_position = {860, 758};
+    const vec2_t default_scale = {1 * 0.08, 1.8 * 0.08};
 
-    const uint8_t * color = colors[color_idx];
+    FILE * const out = fopen("/dev/null", "w");
+    FILE * const in = fopen("/dev/null", "r");
+    SCREEN * screen = NULL;
+    texture_t * texture = NULL;
+    framebuffer_t framebuffer;
+    viewport_t viewport;
+    render_pool_t render_pool;
+    int render_pool_ready = 0;
+    perf_counters_t counters;
+    int success = 0;
+    size_t i, j, k, l;
+
+    framebuffer_init(&framebuffer);
+    scanline_table_init(&viewport.scanline_table);
+    perf_counters_open(&counters);
+
+    /* values are averaged per frame */
+    if (frame_count == 0) {
+        fprintf(stderr, "Frame count must be at least 1\n");
+        goto cleanup;
+    }
 
-    int lum = 0;
-    int max_comp = 0;
-    size_t i;
-    for (i = 0; i < 3; i++) {
-        if (max_comp < color[i]) {
-            max_comp = color[i];
+    if (!out || !in) {
+        fprintf(stderr, "Cannot open /dev/null\n");
+        goto cleanup;
+    }
+
+    screen = newterm("xterm-256color", out, in);
+    if (!screen) {
+        fprintf(stderr, "Cannot initialize ncurses\n");
+        goto cleanup;
+    }
+
+    resize_term(BENCH_HEIGHT + 2, BENCH_WIDTH + 1);
+    start_color();
+
+    palette_shadow_t palette;
+    palette_shadow_init(&palette);
+
+    renderer_context_t renderer_context;
+    renderer_context_init(&renderer_context, &renderers[can_change_color() && COLORS >= 256 ? 3 : 2], stdscr, &palette);
+
+    /* sampling on the calling thread only, so that counters cover all of it */
+    if (!render_pool_init(&render_pool, 0)) {
+        fprintf(stderr, "Cannot initialize render pool\n");
+        goto cleanup;
+    }
+
+    render_pool_ready = 1;
+
+    if (!framebuffer_resize(&framebuffer, BENCH_WIDTH, BENCH_HEIGHT)) {
+        fprintf(stderr, "Cannot allocate framebuffer\n");
+        goto cleanup;
+    }
+
+    if (counters.fds[0] < 0) {
+        printf("Hardware counters not available (%s), timing only\n", strerror(counters.error));
+    }
+
+    printf("%ux%u cells, %lu frames, renderer: %s, values per frame\n", BENCH_WIDTH, BENCH_HEIGHT, frame_count, renderer_context.renderer->name);
+    printf("%-20s %6s %-9s %10s", "map", "orient", "stage", "ns");
+    for (i = 0; i < PERF_COUNTER_COUNT && counters.fds[0] >= 0; i++) {
+        if (counters.fds[i] >= 0) {
+            printf(" %10s", counter_names[i]);
         }
 
-        const int comp_lum = roundf(color[i] / (255.f / 4));
-        if (lum < comp_lum) {
-            lum = comp_lum;
+        if (i == 1) {
+            printf(" %5s", "IPC");
         }
     }
 
-    int normalized_color = 0
-        | (color[0] / (float) max_comp > 0.75 ? 1 : 0) << 2
-        | (color[1] / (float) max_comp > 0.75 ? 1 : 0) << 1
-        | (color[2] / (float) max_comp > 0.75 ? 1 : 0) << 0
-    ;
+    printf("\n");
+
+    for (i = 0; i < map_count; i++) {
+        texture = texture_create(maps[i].file_name, maps[i].default_color_count, 5);
+        if (!texture || !texture_wait(texture)) {
+            fprintf(stderr, "Cannot read image: %s\n", maps[i].file_name);
+            goto cleanup;
+        }
+
+        renderer_context.renderer->init(&renderer_context, texture->colors);
+
+        const sampler_t sampler = {
+            texture,
+            NULL,
+            maps[i].padding_box_pos,
+            maps[i].padding_box_size
+        };
+
+        for (j = 0; j < orientation_count; j++) {
+            bench_stage_t stages[BENCH_STAGE_COUNT];
+            memset(stages, 0, sizeof(stages));
+
+            camera_t camera;
+            camera_init(&camera, default_position, default_scale, orientations[j]);
+
+            viewport.camera = &camera;
+            viewport.orientation_offset = 0;
+            viewport.x = 0;
+            viewport.y = 0;
+            viewport.width = BENCH_WIDTH;
+            viewport.height = BENCH_HEIGHT;
+            viewport.scanline_table.effect = NULL;
+
+            if (!scanline_table_update(&viewport.scanline_table, BENCH_WIDTH, BENCH_HEIGHT, 1, 1, 1, texture->mipmap_count)) {
+                fprintf(stderr, "Cannot allocate scanline table\n");
+                goto cleanup;
+            }
+
+            for (k = 0; k < frame_count; k++) {
+                camera.position.x += 2 * sinf(camera.orientation);
+                camera.position.y -= 2 * cosf(camera.orientation);
+
+                render_job_t job = {
+                    &viewport,
+                    1,
+                    &sampler,
+                    k,
+                    &framebuffer,
+                    0
+                };
+
+                bench_stage_begin(&counters, &stages[BENCH_STAGE_SAMPLING]);
+                render_pool_run(&render_pool, &job);
+                bench_stage_end(&counters, &stages[BENCH_STAGE_SAMPLING]);
+
+                bench_stage_begin(&counters, &stages[BENCH_STAGE_MAPPING]);
+                renderer_draw_framebuffer(&renderer_context, &framebuffer, texture->colors, k);
+                wnoutrefresh(stdscr);
+                bench_stage_end(&counters, &stages[BENCH_STAGE_MAPPING]);
+
+                bench_stage_begin(&counters, &stages[BENCH_STAGE_ENCODING]);
+                doupdate();
+                bench_stage_end(&counters, &stages[BENCH_STAGE_ENCODING]);
+            }
+
+            for (k = 0; k < BENCH_STAGE_COUNT; k++) {
+                printf(
+                    "%-20s %5.0f\xc2\xb0 %-9s %10lu",
+                    strrchr(maps[i].file_name, '/') + 1,
+                    orientations[j] * 180 / M_PI,
+                    stage_names[k],
+                    stages[k].ns / frame_count
+                );
+
+                for (l = 0; l < PERF_COUNTER_COUNT && counters.fds[0] >= 0; l++) {
+                    if (counters.fds[l] >= 0) {
+                        printf(" %10lu", stages[k].counters[l] / frame_count);
+                    }
 
-    if (lum == 0) {
-        normalized_color = 0;
+                    if (l == 1) {
+                        printf(" %5.2f", stages[k].counters[0] ? stages[k].counters[1] / (float) stages[k].counters[0] : 0);
+                    }
+                }
+
+                printf("\n");
+            }
+        }
+
+        texture_destroy(texture);
+        texture = NULL;
     }
 
-    attrset((lum <= 2 ? A_NORMAL : A_BOLD) | A_REVERSE);
-    attron(COLOR_PAIR(normalized_color + 1));
-    mvaddch(y, x, ' ');
-}
+    success = 1;
 
-static void renderer1_init(uint8_t colors[][4])
-{
+cleanup:
+    if (texture) {
+        texture_destroy(texture);
+    }
+
+    if (render_pool_ready) {
+        render_pool_destroy(&render_pool);
+    }
+
+    if (screen) {
+        endwin();
+        delscreen(screen);
+    }
+
+    if (out) {
+        fclose(out);
+    }
+
+    if (in) {
+        fclose(in);
+    }
+
+    perf_counters_close(&counters);
+    scanline_table_destroy(&viewport.scanline_table);
+    framebuffer_destroy(&framebuffer);
+
+    return success;
 }
 
-static void renderer1_draw(size_t x, size_t y, uint8_t colors[][4], uint8_t color_idx)
+/*
+ * Renders every map at several zoom levels, with and without perspective, the camera moving
+ * forward and turning at a constant on screen speed. Reports sampling time, the number of
+ * cells which changed from the previous frame and the range of mipmap levels selected.
+ */
+static int bench_lod_run(const map_t * maps, size_t map_count, size_t frame_count)
 {
-    const char charset[] = " .`^*:;+=%§$#";
-    const size_t charset_size = sizeof(charset) -1;
+    static const float scales[] = {0.25, 0.5, 1, 2, 4};
 
-    const uint8_t * color = colors[color_idx];
-    int lum = 0;
-    size_t i;
-    for (i = 0; i < 3; i++) {
-        const int comp_lum = roundf(color[i] / (255.f / charset_size));
-        if (lum < comp_lum) {
-            lum = comp_lum;
+    const size_t scale_count = sizeof(scales) / sizeof(scales[0]);
+    const vec2_t default_position = {860, 758};
+    const vec2_t default_scale = {1 * 0.08, 1.8 * 0.08};
+
+    texture_t * texture = NULL;
+    framebuffer_t framebuffer;
+    viewport_t viewport;
+    render_pool_t render_pool;
+    int render_pool_ready = 0;
+    uint8_t * previous = NULL;
+    int success = 0;
+    size_t i, j, k;
+    int perspective;
+
+    framebuffer_init(&framebuffer);
+    scanline_table_init(&viewport.scanline_table);
+
+    if (!render_pool_init(&render_pool, 0)) {
+        fprintf(stderr, "Cannot initialize render pool\n");
+        goto cleanup;
+    }
+
+    render_pool_ready = 1;
+
+    previous = malloc(BENCH_WIDTH * BENCH_HEIGHT);
+    if (!previous || !framebuffer_resize(&framebuffer, BENCH_WIDTH, BENCH_HEIGHT)) {
+        fprintf(stderr, "Cannot allocate framebuffer\n");
+        goto cleanup;
+    }
+
+    printf("%ux%u cells, %lu frames, values per frame\n", BENCH_WIDTH, BENCH_HEIGHT, frame_count);
+    printf("%-20s %-11s %5s %10s %8s %7s\n", "map", "view", "scale", "ns", "changed", "mipmaps");
+
+    for (i = 0; i < map_count; i++) {
+        texture = texture_create(maps[i].file_name, maps[i].default_color_count, 5);
+        if (!texture || !texture_wait(texture)) {
+            fprintf(stderr, "Cannot read image: %s\n", maps[i].file_name);
+            goto cleanup;
         }
+
+        const sampler_t sampler = {
+            texture,
+            NULL,
+            maps[i].padding_box_pos,
+            maps[i].padding_box_size
+        };
+
+        for (perspective = 1; perspective >= 0; perspective--) {
+            for (j = 0; j < scale_count; j++) {
+                camera_t camera;
+                camera_init(
+                    &camera,
+                    default_position,
+                    (vec2_t) {default_scale.x * scales[j], default_scale.y * scales[j]},
+                    0
+                );
+
+                viewport.camera = &camera;
+                viewport.orientation_offset = 0;
+                viewport.x = 0;
+                viewport.y = 0;
+                viewport.width = BENCH_WIDTH;
+                viewport.height = BENCH_HEIGHT;
+                viewport.scanline_table.effect = NULL;
+
+                if (!scanline_table_update(&viewport.scanline_table, BENCH_WIDTH, BENCH_HEIGHT, 1, 1, perspective, texture->mipmap_count)) {
+                    fprintf(stderr, "Cannot allocate scanline table\n");
+                    goto cleanup;
+                }
+
+                size_t min_level = texture->mipmap_count;
+                size_t max_level = 0;
+                for (k = 0; k < BENCH_HEIGHT; k++) {
+                    const size_t level = scanline_mipmap_level(
+                        &viewport.scanline_table.scanlines[k],
+                        camera.scale,
+                        texture->mipmap_count
+                    );
+
+                    min_level = level < min_level ? level : min_level;
+                    max_level = level > max_level ? level : max_level;
+                }
+
+                size_t ns = 0;
+                size_t changed_count = 0;
+                for (k = 0; k <= frame_count; k++) {
+                    memcpy(previous, framebuffer.data, BENCH_WIDTH * BENCH_HEIGHT);
+
+                    camera.position.x += 2 * scales[j] * sinf(camera.orientation);
+                    camera.position.y -= 2 * scales[j] * cosf(camera.orientation);
+                    camera.orientation += 0.005;
+
+                    render_job_t job = {
+                        &viewport,
+                        1,
+                        &sampler,
+                        k,
+                        &framebuffer,
+                        0
+                    };
+
+                    const size_t start_ns = current_time_ns();
+                    render_pool_run(&render_pool, &job);
+                    const size_t end_ns = current_time_ns();
+
+                    /* the first frame only fills the previous frame */
+                    if (k == 0) {
+                        continue;
+                    }
+
+                    ns += end_ns - start_ns;
+
+                    size_t l;
+                    for (l = 0; l < BENCH_WIDTH * BENCH_HEIGHT; l++) {
+                        changed_count += framebuffer.data[l] != previous[l];
+                    }
+                }
+
+                printf(
+                    "%-20s %-11s %5.2f %10lu %8lu %4lu-%lu\n",
+                    strrchr(maps[i].file_name, '/') + 1,
+                    perspective ? "perspective" : "flat",
+                    scales[j],
+                    frame_count ? ns / frame_count : 0,
+                    frame_count ? changed_count / frame_count : 0,
+                    min_level,
+                    max_level
+                );
+            }
+        }
+
+        texture_destroy(texture);
+        texture = NULL;
+    }
+
+    success = 1;
+
+cleanup:
+    if (texture) {
+        texture_destroy(texture);
     }
 
-    if (lum >= charset_size) {
-        lum = charset_size - 1;
+    if (render_pool_ready) {
+        render_pool_destroy(&render_pool);
     }
 
-    mvaddch(y, x, charset[lum]);
+    free(previous);
+    scanline_table_destroy(&viewport.scanline_table);
+    framebuffer_destroy(&framebuffer);
+
+    return success;
 }
 
-static size_t current_time_ns(void)
+static uint64_t golden_hash(const framebuffer_t * framebuffer)
 {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
+    /* FNV-1a over dimensions and indexed pixels */
+    uint64_t hash = 0xcbf29ce484222325ull;
+    const uint64_t dims[2] = {framebuffer->width, framebuffer->height};
+    const uint8_t * const bytes = (const uint8_t *) dims;
+
+    size_t i;
+    for (i = 0; i < sizeof(dims); i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
 
-    return ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+    for (i = 0; i < framebuffer->width * framebuffer->height; i++) {
+        hash = (hash ^ framebuffer->data[i]) * 0x100000001b3ull;
+    }
+
+    return hash;
 }
 
-static int kb_event_get()
+static uint8_t golden_reference_sample(const sampler_t * sampler, size_t mipmap_idx, vec2_t tx)
 {
-    static struct {
-        size_t count;
-        size_t last_time_ms;
-    } pressed_keys[512] = {{0}};
+    const texture_t * const texture = sampler->texture;
+    const texture_mimap_t * const mipmap = &texture->mipmaps[mipmap_idx];
 
-    static const size_t pressed_keys_size = sizeof(pressed_keys) / sizeof(pressed_keys[0]);
+    if (0
+        || !(0 <= tx.x && tx.x < texture->width)
+        || !(0 <= tx.y && tx.y < texture->height)
+    ) {
+        tx.x = wrap_repeat(
+            tx.x,
+            sampler->padding_box_pos.x,
+            sampler->padding_box_pos.x + sampler->padding_box_size - 1
+        );
 
-    const size_t current_time_ms = current_time_ns() / (1000 * 1000);
+        tx.y = wrap_repeat(
+            tx.y,
+            sampler->padding_box_pos.y,
+            sampler->padding_box_pos.y + sampler->padding_box_size - 1
+        );
+    }
 
-    const int c = getch();
+    tx.x /= mipmap->ratio;
+    tx.y /= mipmap->ratio;
 
-    if (c == ERR) {
-        goto release_next;
-    }
+    return texture_texel(texture, mipmap, tx.x, tx.y);
+}
 
-    if (c >= pressed_keys_size) {
-        goto release_next;
+/* view matrix of a row of the scalar reference path */
+static void golden_reference_view(
+    const camera_t * camera,
+    int perspective,
+    size_t width,
+    size_t height,
+    size_t y,
+    mat3_t * view_mat
+) {
+    const vec2_t center = {width / 2.f, height * 0.8};
+
+    mat3_identity(view_mat);
+    mat3_translate(view_mat, camera->position.x, camera->position.y);
+    mat3_translate(view_mat, center.x, center.y);
+    mat3_rotate(view_mat, camera->orientation);
+
+    vec2_t perspective_factor = {
+        (width / (y + 1.f)),
+        (((y + 1.f) / height) + 3 * width / height)
+            / ((y + 1.f) / height)
+    };
+
+    if (!perspective) {
+        perspective_factor.x = 30;
+        perspective_factor.y = perspective_factor.x;
     }
 
-    pressed_keys[c].last_time_ms = current_time_ms;
-    pressed_keys[c].count++;
+    mat3_scale(
+        view_mat,
+        camera->scale.x * perspective_factor.x,
+        camera->scale.y * perspective_factor.y
+    );
 
-    if (pressed_keys[c].count > 1) {
-        goto release_next;
-    }
+    mat3_translate(view_mat, -center.x, -center.y);
+}
 
-    printw("press = %d\n", c);
+/*
+ * Compares a rendered framebuffer with the scalar reference path: a view matrix built per row
+ * and applied to each pixel with mat3_transform(). Differences whose reference coordinates lie
+ * on a texel edge are only counted as rounding. Returns the mismatched pixel count.
+ */
+static size_t golden_compare_reference(
+    const sampler_t * sampler,
+    const camera_t * camera,
+    int perspective,
+    const framebuffer_t * framebuffer,
+    size_t * rounding_count
+) {
+    const texture_t * const texture = sampler->texture;
+    const size_t width = framebuffer->width;
+    const size_t height = framebuffer->height;
+    const vec2_t center = {width / 2.f, height * 0.8};
+    size_t mismatch_count = 0;
+    size_t x, y;
+
+    *rounding_count = 0;
+
+    for (y = 0; y < height; y++) {
+        mat3_t view_mat, next_view_mat;
+        golden_reference_view(camera, perspective, width, height, y, &view_mat);
+        golden_reference_view(camera, perspective, width, height, y + 1, &next_view_mat);
+
+        /* texels between the center pixel and its right and bottom neighbors */
+        vec2_t pixel = {center.x, y};
+        vec2_t right = {center.x + 1, y};
+        vec2_t below = {center.x, y + 1};
+        mat3_transform(&view_mat, &pixel);
+        mat3_transform(&view_mat, &right);
+        mat3_transform(&next_view_mat, &below);
+
+        const size_t mipmap_idx = mipmap_level_select(
+            fmaxf(
+                hypotf(right.x - pixel.x, right.y - pixel.y),
+                hypotf(below.x - pixel.x, below.y - pixel.y)
+            ),
+            texture->mipmap_count
+        );
 
-    return c;
+        const float tolerance = GOLDEN_EDGE_TOLERANCE * texture->mipmaps[mipmap_idx].ratio;
 
-release_next:
-    {
-        size_t i;
-        for (i = 0; i < pressed_keys_size; i++) {
-            if (pressed_keys[i].count == 0) {
+        for (x = 0; x < width; x++) {
+            vec2_t tx = {x, y};
+            mat3_transform(&view_mat, &tx);
+
+            const uint8_t expected = golden_reference_sample(sampler, mipmap_idx, tx);
+            const uint8_t actual = framebuffer->data[y * width + x];
+            if (actual == expected) {
                 continue;
             }
 
-            const size_t last_time_delay_ms = current_time_ms - pressed_keys[i].last_time_ms;
-            if (
-                (pressed_keys[i].count == 1 && last_time_delay_ms > 600)
-                || (pressed_keys[i].count > 1 && last_time_delay_ms > 120)
-            ) {
-                pressed_keys[i].count = 0;
+            int rounding = 0;
+            size_t k;
+            for (k = 0; k < 4 && !rounding; k++) {
+                const vec2_t corner = {
+                    tx.x + (k & 1 ? tolerance : -tolerance),
+                    tx.y + (k & 2 ? tolerance : -tolerance)
+                };
 
-                printw("release = %d\n", i);
+                rounding = golden_reference_sample(sampler, mipmap_idx, corner) == actual;
+            }
 
-                return i | KB_EVENT_RELEASE;
+            if (rounding) {
+                (*rounding_count)++;
+                continue;
+            }
+
+            if (mismatch_count < GOLDEN_REPORTED_PIXELS) {
+                printf(
+                    "    pixel %3lu, %3lu: %3u instead of %3u (texel %.3f, %.3f, mipmap %lu)\n",
+                    x,
+                    y,
+                    actual,
+                    expected,
+                    tx.x,
+                    tx.y,
+                    mipmap_idx
+                );
             }
+
+            mismatch_count++;
         }
     }
 
-    return ERR;
-}
+    if (mismatch_count > GOLDEN_REPORTED_PIXELS) {
+        printf("    ... and %lu more pixels\n", mismatch_count - GOLDEN_REPORTED_PIXELS);
+    }
 
-static void accelerator_init(accelerator_t * accelerator, float acceleration, float deceleration, float max)
-{
-    accelerator->acceleration = acceleration;
-    accelerator->deceleration = deceleration;
-    accelerator->max = max;
-    accelerator->last_time_ms = 0;
-    accelerator->active = 0;
-    accelerator->reverse = 0;
-    accelerator->velocity = 0;
+    return mismatch_count;
 }
 
-static void accelerator_press(accelerator_t * accelerator, int reverse)
+/*
+ * Renders fixed camera poses of every map headlessly, through the same threaded path as the
+ * demo. Framebuffer hashes are recorded to, or checked against, a golden file, and every frame
+ * is checked against the scalar reference path. Returns 1 when every check passed.
+ */
+static int golden_run(const map_t * maps, size_t map_count, const char * file_name, int record)
 {
-    accelerator->active = 1;
-    accelerator->reverse = reverse;
-}
+    static const struct {
+        vec2_t position;
+        float orientation;
+        float zoom;
+        int perspective;
+        size_t width;
+        size_t height;
+    } poses[] = {
+        {{860, 758}, 0, 1, 1, 158, 46},
+        {{512, 512}, M_PI / 3, 1, 1, 158, 46},
+        {{100, 900}, -2.5, 0.5, 1, 78, 22},
+        {{860, 758}, 0.7, 1, 0, 158, 46},
+        {{1000, 20}, M_PI, 2, 0, 78, 22},
+        {{-300, 1500}, 4, 1.5, 1, 211, 61},
+    };
 
-static void accelerator_release(accelerator_t * accelerator)
-{
-    accelerator->active = 0;
-}
+    const size_t pose_count = sizeof(poses) / sizeof(poses[0]);
+    const vec2_t default_scale = {1 * 0.08, 1.8 * 0.08};
 
-static float accelerator_step_distance(accelerator_t * accelerator)
-{
-    const size_t current_time_ms = current_time_ns() / (1000 * 1000);
-    if (accelerator->last_time_ms == 0) {
-        accelerator->last_time_ms = current_time_ms;
+    uint64_t * const hashes = calloc(map_count * pose_count, sizeof(*hashes));
+    uint64_t * const golden_hashes = calloc(map_count * pose_count, sizeof(*golden_hashes));
+    int * const golden_found = calloc(map_count * pose_count, sizeof(*golden_found));
+    texture_t * texture = NULL;
+    framebuffer_t framebuffer;
+    viewport_t viewport;
+    render_pool_t render_pool;
+    int render_pool_ready = 0;
+    int completed = 0;
+    int success = 1;
+    size_t i, j;
+
+    framebuffer_init(&framebuffer);
+    scanline_table_init(&viewport.scanline_table);
+
+    if (!hashes || !golden_hashes || !golden_found) {
+        fprintf(stderr, "Cannot allocate golden hashes\n");
+        goto cleanup;
     }
 
-    const float time_diff = (current_time_ms - accelerator->last_time_ms) / 1000.f;
-    const float distance = accelerator->velocity * time_diff;
+    if (!record) {
+        FILE * const fp = fopen(file_name, "r");
+        if (fp) {
+            char name[256];
+            unsigned long pose;
+            unsigned long long hash;
+            while (fscanf(fp, "%255s %lu %llx", name, &pose, &hash) == 3) {
+                for (i = 0; i < map_count; i++) {
+                    if (strcmp(name, strrchr(maps[i].file_name, '/') + 1) == 0 && pose < pose_count) {
+                        golden_hashes[i * pose_count + pose] = hash;
+                        golden_found[i * pose_count + pose] = 1;
+                    }
+                }
+            }
 
-    const int dir = accelerator->reverse ? -1 : 1;
+            fclose(fp);
+        } else {
+            printf("No golden file %s, only checking against the reference path\n", file_name);
+        }
+    }
 
-    if (accelerator->active) {
-        accelerator->velocity += dir * accelerator->acceleration * time_diff;
-        if (dir * accelerator->velocity > accelerator->max) {
-            accelerator->velocity = dir * accelerator->max;
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (!render_pool_init(&render_pool, cpu_count > 1 ? cpu_count - 1 : 0)) {
+        fprintf(stderr, "Cannot start render threads\n");
+        goto cleanup;
+    }
+
+    render_pool_ready = 1;
+
+    for (i = 0; i < map_count; i++) {
+        const char * const map_name = strrchr(maps[i].file_name, '/') + 1;
+
+        texture = texture_create(maps[i].file_name, maps[i].default_color_count, 5);
+        if (!texture || !texture_wait(texture)) {
+            fprintf(stderr, "Cannot read image: %s\n", maps[i].file_name);
+            goto cleanup;
         }
-    } else if (accelerator->velocity != 0) {
-        accelerator->velocity -= dir * accelerator->deceleration * time_diff;
-        if (dir * accelerator->velocity < 0) {
-            accelerator->velocity = 0;
+
+        const sampler_t sampler = {
+            texture,
+            NULL,
+            maps[i].padding_box_pos,
+            maps[i].padding_box_size
+        };
+
+        for (j = 0; j < pose_count; j++) {
+            camera_t camera;
+            camera_init(
+                &camera,
+                poses[j].position,
+                (vec2_t) {default_scale.x * poses[j].zoom, default_scale.y * poses[j].zoom},
+                poses[j].orientation
+            );
+
+            if (!framebuffer_resize(&framebuffer, poses[j].width, poses[j].height)) {
+                fprintf(stderr, "Cannot allocate framebuffer\n");
+                goto cleanup;
+            }
+
+            viewport.camera = &camera;
+            viewport.orientation_offset = 0;
+            viewport.x = 0;
+            viewport.y = 0;
+            viewport.width = poses[j].width;
+            viewport.height = poses[j].height;
+            viewport.scanline_table.effect = NULL;
+
+            if (!scanline_table_update(
+                &viewport.scanline_table,
+                viewport.width,
+                viewport.height,
+                1,
+                1,
+                poses[j].perspective,
+                texture->mipmap_count
+            )) {
+                fprintf(stderr, "Cannot allocate scanline table\n");
+                goto cleanup;
+            }
+
+            render_job_t job = {
+                &viewport,
+                1,
+                &sampler,
+                0,
+                &framebuffer,
+                0
+            };
+
+            render_pool_run(&render_pool, &job);
+
+            const uint64_t hash = golden_hash(&framebuffer);
+            hashes[i * pose_count + j] = hash;
+
+            const char * golden_status = "recorded";
+            if (!record) {
+                if (!golden_found[i * pose_count + j]) {
+                    golden_status = "no golden value";
+                } else if (golden_hashes[i * pose_count + j] == hash) {
+                    golden_status = "golden ok";
+                } else {
+                    golden_status = "GOLDEN MISMATCH";
+                    success = 0;
+                }
+            }
+
+            printf("%s pose %lu: %016llx %s\n", map_name, j, (unsigned long long) hash, golden_status);
+
+            size_t rounding_count;
+            const size_t mismatch_count = golden_compare_reference(
+                &sampler,
+                &camera,
+                poses[j].perspective,
+                &framebuffer,
+                &rounding_count
+            );
+
+            if (mismatch_count) {
+                printf(
+                    "    REFERENCE MISMATCH: %lu of %lu pixels\n",
+                    mismatch_count,
+                    framebuffer.width * framebuffer.height
+                );
+                success = 0;
+            }
+
+            if (rounding_count) {
+                printf("    %lu pixels rounded differently on texel edges\n", rounding_count);
+            }
         }
+
+        texture_destroy(texture);
+        texture = NULL;
     }
 
-    accelerator->last_time_ms = current_time_ms;
+    if (record) {
+        FILE * const fp = fopen(file_name, "w");
+        if (!fp) {
+            fprintf(stderr, "Cannot write golden file: %s\n", file_name);
+            goto cleanup;
+        }
 
-    return distance;
-}
+        for (i = 0; i < map_count; i++) {
+            for (j = 0; j < pose_count; j++) {
+                fprintf(
+                    fp,
+                    "%s %lu %016llx\n",
+                    strrchr(maps[i].file_name, '/') + 1,
+                    j,
+                    (unsigned long long) hashes[i * pose_count + j]
+                );
+            }
+        }
 
-static float accelerator_velocity(const accelerator_t * accelerator)
-{
-    return accelerator->velocity;
+        fclose(fp);
+        printf("Golden values written to %s\n", file_name);
+    }
+
+    printf(success ? "All frames match\n" : "Some frames do not match\n");
+    completed = 1;
+
+cleanup:
+    if (texture) {
+        texture_destroy(texture);
+    }
+
+    if (render_pool_ready) {
+        render_pool_destroy(&render_pool);
+    }
+
+    scanline_table_destroy(&viewport.scanline_table);
+    framebuffer_destroy(&framebuffer);
+    free(golden_found);
+    free(golden_hashes);
+    free(hashes);
+
+    return completed && success;
 }
@@ -0,0 +1,2707 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <time.h>
+#include <wchar.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
+
+#include <ncurses.h>
+
+#include "mode7.h"
+
+#ifdef ENABLE_TRACE
+
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+    const char * name;
+    size_t begin_ns;
+    size_t end_ns;
+} trace_event_t;
+
+typedef struct trace_buffer_s {
+    trace_event_t events[TRACE_BUFFER_SIZE];
+    size_t count;
+    size_t tid;
+    const char * thread_name;
+    int released;             /* its thread exited, another thread may record to it */
+    struct trace_buffer_s * next;
+} trace_buffer_t;
+
+#endif
+
+static int image_decode_rle(image_t * image, const uint8_t * src, size_t size, int bpp);
+static void * texture_loader(void * arg);
+
+static void renderer256_init(renderer_context_t * context, uint8_t colors[][4]);
+static void renderer256_draw(renderer_context_t * context, size_t x, size_t y, uint8_t colors[][4], uint8_t color_idx);
+static void renderer16_init(renderer_context_t * context, uint8_t colors[][4]);
+static void renderer16_draw(renderer_context_t * context, size_t x, size_t y, uint8_t colors[][4], uint8_t color_idx);
+static void renderer1_init(renderer_context_t * context, uint8_t colors[][4]);
+static void renderer1_draw(renderer_context_t * context, size_t x, size_t y, uint8_t colors[][4], uint8_t color_idx);
+static void renderer_braille_init(renderer_context_t * context, uint8_t colors[][4]);
+static void renderer_braille_draw(renderer_context_t * context, size_t x, size_t y, uint8_t colors[][4], uint8_t color_idx);
+static void renderer_braille_draw_block(renderer_context_t * context, size_t x, size_t y, const uint8_t * texels, size_t stride);
+
+const renderer_t renderers[RENDERER_COUNT] = {
+    {"braille", 2, 4, renderer_braille_init, renderer_braille_draw, renderer_braille_draw_block},
+    {"monochrome", 1, 1, renderer1_init, renderer1_draw, NULL},
+    {"16 colors", 1, 1, renderer16_init, renderer16_draw, NULL},
+    {"256 colors", 1, 1, renderer256_init, renderer256_draw, NULL},
+};
+
+static uint16_t read_le16(const uint8_t * p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t read_le32(const uint8_t * p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void write_le32(uint8_t * p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+image_t * image_create(const char * file_name)
+{
+    TRACE_ZONE("image_create");
+
+    /*
+     * Indexed (4 or 8 bits) BMP v3 are supported, uncompressed or RLE compressed.
+     * Use this ImageMagick command to convert an image to this format:
+     *   convert in.png -colors 256 BMP3:out.bmp
+     *
+     * The file is memory mapped, uncompressed top-down 8 bits images without
+     * line padding are used in place (zero-copy). The mapping is private so
+     * that in place modifications (e.g. quantization) never reach the file.
+     */
+
+    image_t * image = NULL;
+    int fd = -1;
+
+    image = malloc(sizeof(*image));
+    if (!image) {
+        goto error;
+    }
+
+    image->data = NULL;
+    image->mapping = MAP_FAILED;
+    image->mapping_size = 0;
+    memset(image->colors, 0, sizeof(image->colors));
+
+    fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        goto error;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 54) {
+        goto error;
+    }
+
+    image->mapping_size = st.st_size;
+    image->mapping = mmap(NULL, image->mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (image->mapping == MAP_FAILED) {
+        goto error;
+    }
+
+    close(fd);
+    fd = -1;
+
+    const uint8_t * const file = image->mapping;
+    const size_t file_size = image->mapping_size;
+
+    if (file[0] != 'B' || file[1] != 'M') {
+        goto error;
+    }
+
+    const size_t data_offset = read_le32(file + 10);
+    const size_t info_size = read_le32(file + 14);
+    const int32_t width = read_le32(file + 18);
+    const int32_t height = read_le32(file + 22);
+    const int bpp = read_le16(file + 28);
+    const uint32_t compression = read_le32(file + 30);
+    size_t palette_size = read_le32(file + 46);
+
+    if (0
+        || info_size < 40
+        || 14 + info_size > data_offset
+        || data_offset >= file_size
+        || width <= 0
+        || height == 0
+        || height == INT32_MIN
+        || read_le16(file + 26) != 1
+        || (bpp != 4 && bpp != 8)
+    ) {
+        goto error;
+    }
+
+    /* BI_RGB, BI_RLE8 or BI_RLE4, top-down images cannot be compressed */
+    if (0
+        || (compression != 0 && compression != (bpp == 8 ? 1 : 2))
+        || (compression != 0 && height < 0)
+    ) {
+        goto error;
+    }
+
+    if (palette_size == 0) {
+        palette_size = 1 << bpp;
+    }
+
+    if (palette_size > (size_t) 1 << bpp || 14 + info_size + palette_size * 4 > data_offset) {
+        goto error;
+    }
+
+    image->width = width;
+    image->height = height < 0 ? -height : height;
+
+    size_t i;
+    /* BGRA -> RGBA */
+    for (i = 0; i < palette_size; i++) {
+        const uint8_t * const color = file + 14 + info_size + i * 4;
+        image->colors[i][0] = color[2];
+        image->colors[i][1] = color[1];
+        image->colors[i][2] = color[0];
+        image->colors[i][3] = color[3];
+    }
+
+    const uint8_t * const pixels = file + data_offset;
+    const size_t pixels_size = file_size - data_offset;
+
+    if (compression != 0) {
+        image->data = calloc(image->width * image->height, 1);
+        if (!image->data) {
+            goto error;
+        }
+
+        if (!image_decode_rle(image, pixels, pixels_size, bpp)) {
+            goto error;
+        }
+
+        goto unmap;
+    }
+
+    const size_t stride = ((image->width * bpp + 31) / 32) * 4;
+    if (stride * image->height > pixels_size) {
+        goto error;
+    }
+
+    if (bpp == 8 && height < 0 && stride == image->width) {
+        image->data = (uint8_t *) pixels;
+
+        return image;
+    }
+
+    image->data = malloc(image->width * image->height);
+    if (!image->data) {
+        goto error;
+    }
+
+    for (i = 0; i < image->height; i++) {
+        const uint8_t * const src = pixels + i * stride;
+        uint8_t * const dst = image->data + (height < 0 ? i : image->height - i - 1) * image->width;
+
+        if (bpp == 8) {
+            memcpy(dst, src, image->width);
+            continue;
+        }
+
+        size_t j;
+        for (j = 0; j < image->width; j++) {
+            dst[j] = (src[j / 2] >> (j % 2 ? 0 : 4)) & 0xf;
+        }
+    }
+
+unmap:
+    munmap(image->mapping, image->mapping_size);
+    image->mapping = MAP_FAILED;
+
+    return image;
+
+error:
+    if (image) {
+        /* data never points into the mapping at this point */
+        free(image->data);
+
+        if (image->mapping != MAP_FAILED) {
+            munmap(image->mapping, image->mapping_size);
+        }
+    }
+
+    free(image);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static int image_decode_rle(image_t * image, const uint8_t * src, size_t size, int bpp)
+{
+    /* RLE images are always bottom-up */
+    size_t x = 0;
+    size_t y = 0;
+    size_t i = 0;
+
+#define RLE_PUT(v) do { \
+        if (x < image->width && y < image->height) { \
+            image->data[(image->height - y - 1) * image->width + x] = (v); \
+        } \
+        x++; \
+    } while (0)
+
+    while (i + 1 < size) {
+        const size_t count = src[i];
+        const uint8_t value = src[i + 1];
+        i += 2;
+
+        if (count > 0) {
+            size_t k;
+            for (k = 0; k < count; k++) {
+                RLE_PUT(bpp == 8 ? value : (value >> (k % 2 ? 0 : 4)) & 0xf);
+            }
+
+            continue;
+        }
+
+        switch (value) {
+            case 0: /* end of line */
+                x = 0;
+                y++;
+                break;
+
+            case 1: /* end of bitmap */
+                return 1;
+
+            case 2: /* delta */
+                if (i + 1 >= size) {
+                    return 0;
+                }
+
+                x += src[i];
+                y += src[i + 1];
+                i += 2;
+                break;
+
+            default: /* absolute run of `value` pixels, padded to 16 bits */
+                {
+                    const size_t run_size = bpp == 8 ? value : (value + 1) / 2;
+                    if (i + run_size > size) {
+                        return 0;
+                    }
+
+                    size_t k;
+                    for (k = 0; k < value; k++) {
+                        RLE_PUT(bpp == 8 ? src[i + k] : (src[i + k / 2] >> (k % 2 ? 0 : 4)) & 0xf);
+                    }
+
+                    i += run_size + run_size % 2;
+                }
+                break;
+        }
+    }
+
+#undef RLE_PUT
+
+    /* tolerate a missing end of bitmap marker */
+    return 1;
+}
+
+void image_quantize(image_t * image, size_t max_color_count)
+{
+    TRACE_ZONE("image_quantize");
+
+    /* merges are applied to the color stats, texels are remapped once at the end */
+    uint32_t stats[256] = {0};
+    uint8_t remap[256];
+    int merged = 0;
+    size_t i;
+
+    for (i = 0; i < image->width * image->height; i++) {
+        stats[image->data[i]]++;
+    }
+
+    for (i = 0; i < 256; i++) {
+        remap[i] = i;
+    }
+
+    while (1) {
+        size_t color_count = 0;
+        for (i = 0; i < 256; i++) {
+            if (stats[i] > 0) {
+                color_count++;
+            }
+        }
+
+        if (color_count < 2 || color_count <= max_color_count) {
+            break;
+        }
+
+        struct {
+            uint8_t a;
+            uint8_t b;
+            float dist;
+        } nearest = {0, 0, FLT_MAX};
+
+        for (i = 0; i < 256; i++) {
+            if (stats[i] == 0) {
+                continue;
+            }
+
+            size_t j;
+            for (j = 0; j < 256; j++) {
+                if (i >= j) {
+                    continue;
+                }
+
+                if (stats[j] == 0) {
+                    continue;
+                }
+
+                const float dist = sqrtf(0
+                    + powf(image->colors[i][0] - image->colors[j][0], 2)
+                    + powf(image->colors[i][1] - image->colors[j][1], 2)
+                    + powf(image->colors[i][2] - image->colors[j][2], 2)
+                );
+
+                if (nearest.dist > dist) {
+                    nearest.dist = dist;
+                    nearest.a = i;
+                    nearest.b = j;
+                }
+            }
+        }
+
+        for (i = 0; i < 3; i++) {
+            image->colors[nearest.a][i] = (0
+                + image->colors[nearest.a][i] * stats[nearest.a]
+                + image->colors[nearest.b][i] * stats[nearest.b]
+            ) / (0
+                + stats[nearest.a]
+                + stats[nearest.b]
+            );
+        }
+
+        stats[nearest.a] += stats[nearest.b];
+        stats[nearest.b] = 0;
+
+        for (i = 0; i < 256; i++) {
+            if (remap[i] == nearest.b) {
+                remap[i] = nearest.a;
+            }
+        }
+
+        merged = 1;
+    }
+
+    for (i = 0; merged && i < image->width * image->height; i++) {
+        image->data[i] = remap[image->data[i]];
+    }
+}
+
+/* writes the w x h downsized image indices to data, averaging colors of each block into colors the image uses */
+void image_downsize(const image_t * image, size_t w, size_t h, uint8_t * data)
+{
+    TRACE_ZONE("image_downsize");
+
+    if (0
+        || w >= image->width || image->width % w
+        || h >= image->height || image->height % h
+    ) {
+        fprintf(stderr, "Invalid downsizing parameters\n");
+        exit(1);
+    }
+
+    /*
+     * Palette entries merged away by image_quantize() must not come back,
+     * only used colors are considered, in index order.
+     */
+    uint8_t used[256] = {0};
+    size_t i;
+    for (i = 0; i < image->width * image->height; i++) {
+        used[image->data[i]] = 1;
+    }
+
+    uint8_t used_colors[256];
+    size_t used_count = 0;
+    for (i = 0; i < 256; i++) {
+        if (used[i]) {
+            used_colors[used_count++] = i;
+        }
+    }
+
+    const size_t hr = image->height / h;
+    const size_t wr = image->width / w;
+    uint16_t stats[256];
+    for (i = 0; i < h; i++) {
+        size_t j;
+        for (j = 0; j < w; j++) {
+            size_t k;
+            for (k = 0; k < used_count; k++) {
+                stats[used_colors[k]] = 0;
+            }
+
+            for (k = 0; k < hr; k++) {
+                size_t l;
+                for (l = 0; l < wr; l++) {
+                    stats[image->data[(i * hr + k) * image->width + (j * wr + l)]]++;
+                }
+            }
+
+            size_t avg[3] = {0};
+            for (k = 0; k < used_count; k++) {
+                const uint8_t c = used_colors[k];
+                avg[0] += image->colors[c][0] * stats[c];
+                avg[1] += image->colors[c][1] * stats[c];
+                avg[2] += image->colors[c][2] * stats[c];
+            }
+
+            avg[0] /= hr * wr;
+            avg[1] /= hr * wr;
+            avg[2] /= hr * wr;
+
+            struct {
+                uint8_t idx;
+                size_t dist;
+            } nearest = {0, SIZE_MAX};
+
+            for (k = 0; k < used_count; k++) {
+                const uint8_t c = used_colors[k];
+
+                /*
+                 * This is not the vector length, we just need a fast approximation of relative distance.
+                 */
+                const size_t dist = 0
+                    + abs(avg[0] - image->colors[c][0])
+                    + abs(avg[1] - image->colors[c][1])
+                    + abs(avg[2] - image->colors[c][2])
+                ;
+
+                if (nearest.dist > dist) {
+                    nearest.dist = dist;
+                    nearest.idx = c;
+                }
+            }
+
+            data[i * w + j] = nearest.idx;
+        }
+    }
+}
+
+void image_destroy(image_t * image)
+{
+    if (image->mapping != MAP_FAILED) {
+        munmap(image->mapping, image->mapping_size);
+    } else {
+        free(image->data);
+    }
+
+    free(image);
+}
+
+texture_t * texture_create(const char * file_name, size_t max_color_count, size_t mipmap_count)
+{
+    TRACE_ZONE("texture_create");
+
+    texture_t * texture = malloc(sizeof(*texture));
+    if (!texture) {
+        return NULL;
+    }
+
+    texture->arena = NULL;
+    texture->loading = 0;
+    texture->cancel = 0;
+    texture->failed = 0;
+    texture->max_color_count = max_color_count;
+
+    const size_t max_mipmap_count = sizeof(texture->mipmaps) / sizeof(texture->mipmaps[0]);
+    
+    if (mipmap_count == 0) {
+        mipmap_count = 1;
+    }
+
+    if (mipmap_count > max_mipmap_count) {
+        mipmap_count = max_mipmap_count;
+    }
+
+    texture->mipmap_count = mipmap_count;
+
+    size_t i;
+    for (i = 0; i < max_mipmap_count; i++) {
+        texture->mipmaps[i].ready = 0;
+    }
+
+    texture->image = image_create(file_name);
+    if (!texture->image) {
+        goto error;
+    }
+
+    texture->width = texture->image->width;
+    texture->height = texture->image->height;
+
+    if (pthread_create(&texture->loader, NULL, texture_loader, texture) != 0) {
+        goto error;
+    }
+
+    texture->loading = 1;
+
+    return texture;
+
+error:
+    texture_destroy(texture);
+
+    return NULL;
+}
+
+/* stores 8 bits indices as level `idx`, packing them when the texture is packed */
+static void texture_store_level(texture_t * texture, size_t idx, const uint8_t * src, const uint8_t * nibbles)
+{
+    texture_mimap_t * const mipmap = &texture->mipmaps[idx];
+
+    if (!texture->packed) {
+        if (src != mipmap->data) {
+            memcpy(mipmap->data, src, mipmap->width * mipmap->height);
+        }
+
+        return;
+    }
+
+    size_t x, y;
+    for (y = 0; y < mipmap->height; y++) {
+        const uint8_t * const row = src + y * mipmap->width;
+        uint8_t * const dst = mipmap->data + y * mipmap->stride;
+        memset(dst, 0, mipmap->stride);
+
+        for (x = 0; x < mipmap->width; x++) {
+            dst[x >> 1] |= nibbles[row[x]] << ((x & 1) * 4);
+        }
+    }
+}
+
+/*
+ * Builds the texture in the background: quantized level 0 and palette first, so that
+ * rendering can start, then coarser levels from the coarsest, each one published as
+ * soon as it is complete.
+ */
+static void * texture_loader(void * arg)
+{
+    texture_t * const texture = arg;
+    image_t * const image = texture->image;
+    uint8_t * scratch = NULL;
+
+    TRACE_THREAD_NAME("texture loader");
+    TRACE_ZONE("texture load");
+
+    image_quantize(image, texture->max_color_count);
+
+    /* mipmaps only use colors of the quantized level 0 */
+    uint8_t * const used = texture->used_colors;
+    memset(used, 0, sizeof(texture->used_colors));
+    size_t i;
+    for (i = 0; i < image->width * image->height; i++) {
+        used[image->data[i]] = 1;
+    }
+
+    uint8_t nibbles[256] = {0};
+    size_t used_count = 0;
+    for (i = 0; i < 256; i++) {
+        if (used[i]) {
+            nibbles[i] = used_count++;
+        }
+    }
+
+    texture->packed = used_count <= 16;
+
+    /* palette, nibble colors, then levels, each aligned */
+    const size_t align = TEXTURE_ARENA_ALIGNMENT;
+    size_t offsets[8];
+    size_t arena_size = (256 * sizeof(texture->colors[0]) + 16 + align - 1) / align * align;
+    for (i = 0; i < texture->mipmap_count; i++) {
+        texture_mimap_t * const mipmap = &texture->mipmaps[i];
+        mipmap->width = image->width >> i;
+        mipmap->height = image->height >> i;
+        mipmap->stride = texture->packed ? (mipmap->width + 1) / 2 : mipmap->width;
+        mipmap->ratio = (size_t) 1 << i;
+
+        offsets[i] = arena_size;
+        arena_size += (mipmap->stride * mipmap->height + align - 1) / align * align;
+    }
+
+    uint8_t * const arena = aligned_alloc(align, arena_size);
+    if (!arena) {
+        goto error;
+    }
+
+    texture->arena = arena;
+    texture->colors = (uint8_t (*)[4]) arena;
+    texture->nibble_colors = arena + 256 * sizeof(texture->colors[0]);
+    memcpy(texture->colors, image->colors, 256 * sizeof(texture->colors[0]));
+
+    for (i = 0; i < 256; i++) {
+        if (used[i] && texture->packed) {
+            texture->nibble_colors[nibbles[i]] = i;
+        }
+    }
+
+    for (i = 0; i < texture->mipmap_count; i++) {
+        texture->mipmaps[i].data = arena + offsets[i];
+    }
+
+    texture_store_level(texture, 0, image->data, nibbles);
+    __atomic_store_n(&texture->mipmaps[0].ready, 1, __ATOMIC_RELEASE);
+
+    if (texture->mipmap_count > 1 && texture->packed) {
+        scratch = malloc(texture->mipmaps[1].width * texture->mipmaps[1].height);
+        if (!scratch) {
+            goto error;
+        }
+    }
+
+    for (i = texture->mipmap_count - 1; i > 0; i--) {
+        if (__atomic_load_n(&texture->cancel, __ATOMIC_RELAXED)) {
+            break;
+        }
+
+        texture_mimap_t * const mipmap = &texture->mipmaps[i];
+        uint8_t * const level = scratch ? scratch : mipmap->data;
+        image_downsize(image, mipmap->width, mipmap->height, level);
+        texture_store_level(texture, i, level, nibbles);
+        __atomic_store_n(&mipmap->ready, 1, __ATOMIC_RELEASE);
+    }
+
+    free(scratch);
+
+    /* level 0 now lives in the arena, image is only read again after the loader is joined */
+    image_destroy(image);
+    texture->image = NULL;
+
+    return NULL;
+
+error:
+    free(scratch);
+    image_destroy(image);
+    texture->image = NULL;
+    __atomic_store_n(&texture->failed, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/* waits for every level, returns 0 when loading failed */
+int texture_wait(texture_t * texture)
+{
+    if (texture->loading) {
+        pthread_join(texture->loader, NULL);
+        texture->loading = 0;
+    }
+
+    return !texture->failed;
+}
+
+/* level 0 and the palette are available */
+int texture_ready(const texture_t * texture)
+{
+    return __atomic_load_n(&texture->mipmaps[0].ready, __ATOMIC_ACQUIRE);
+}
+
+int texture_failed(const texture_t * texture)
+{
+    return __atomic_load_n(&texture->failed, __ATOMIC_ACQUIRE);
+}
+
+size_t texture_ready_count(const texture_t * texture)
+{
+    size_t i, count = 0;
+    for (i = 0; i < texture->mipmap_count; i++) {
+        count += __atomic_load_n(&texture->mipmaps[i].ready, __ATOMIC_ACQUIRE);
+    }
+
+    return count;
+}
+
+/* the requested level, or the nearest loaded one (coarser first), NULL when nothing is loaded */
+const texture_mimap_t * texture_level(const texture_t * texture, size_t idx)
+{
+    size_t i;
+    for (i = idx; i < texture->mipmap_count; i++) {
+        if (__atomic_load_n(&texture->mipmaps[i].ready, __ATOMIC_ACQUIRE)) {
+            return &texture->mipmaps[i];
+        }
+    }
+
+    for (i = idx; i > 0; i--) {
+        if (__atomic_load_n(&texture->mipmaps[i - 1].ready, __ATOMIC_ACQUIRE)) {
+            return &texture->mipmaps[i - 1];
+        }
+    }
+
+    return NULL;
+}
+
+uint8_t texture_texel(const texture_t * texture, const texture_mimap_t * mipmap, size_t x, size_t y)
+{
+    const uint8_t * const row = mipmap->data + y * mipmap->stride;
+
+    if (texture->packed) {
+        return texture->nibble_colors[(row[x >> 1] >> ((x & 1) * 4)) & 0xf];
+    }
+
+    return row[x];
+}
+
+void texture_destroy(texture_t * texture)
+{
+    __atomic_store_n(&texture->cancel, 1, __ATOMIC_RELAXED);
+    texture_wait(texture);
+
+    if (texture->image) {
+        image_destroy(texture->image);
+    }
+
+    free(texture->arena);
+    free(texture);
+}
+
+int vtexture_write(const texture_t * texture, const char * file_name)
+{
+    const size_t page_size = VTEXTURE_PAGE_SIZE;
+
+    FILE * fp = fopen(file_name, "wb");
+    if (!fp) {
+        return 0;
+    }
+
+    uint8_t header[VTEXTURE_DATA_OFFSET];
+    memset(header, 0, sizeof(header));
+    memcpy(header, VTEXTURE_MAGIC, 8);
+    write_le32(header + 8, texture->width);
+    write_le32(header + 12, texture->height);
+    write_le32(header + 16, page_size);
+    write_le32(header + 20, texture->mipmap_count);
+    memcpy(header + 24, texture->colors, 256 * sizeof(texture->colors[0]));
+
+    if (fwrite(header, sizeof(header), 1, fp) != 1) {
+        goto error;
+    }
+
+    uint8_t page[VTEXTURE_PAGE_SIZE * VTEXTURE_PAGE_SIZE];
+    size_t i;
+    for (i = 0; i < texture->mipmap_count; i++) {
+        const texture_mimap_t * const mipmap = &texture->mipmaps[i];
+        const size_t pages_x = (mipmap->width + page_size - 1) / page_size;
+        const size_t pages_y = (mipmap->height + page_size - 1) / page_size;
+
+        size_t py, px;
+        for (py = 0; py < pages_y; py++) {
+            for (px = 0; px < pages_x; px++) {
+                memset(page, 0, sizeof(page));
+
+                size_t y, x;
+                for (y = 0; y < page_size && py * page_size + y < mipmap->height; y++) {
+                    for (x = 0; x < page_size && px * page_size + x < mipmap->width; x++) {
+                        page[y * page_size + x] = texture_texel(texture, mipmap, px * page_size + x, py * page_size + y);
+                    }
+                }
+
+                if (fwrite(page, sizeof(page), 1, fp) != 1) {
+                    goto error;
+                }
+            }
+        }
+    }
+
+    if (fclose(fp) != 0) {
+        return 0;
+    }
+
+    return 1;
+
+error:
+    fclose(fp);
+
+    return 0;
+}
+
+static size_t vtexture_hash(uint32_t key)
+{
+    return (key * 2654435761u) % VTEXTURE_HASH_SIZE;
+}
+
+static vtexture_page_t * vtexture_lookup(vtexture_t * vtexture, uint32_t key)
+{
+    int i = vtexture->hash[vtexture_hash(key)];
+    while (i >= 0) {
+        if (vtexture->pages[i].key == key) {
+            return &vtexture->pages[i];
+        }
+
+        i = vtexture->pages[i].hash_next;
+    }
+
+    return NULL;
+}
+
+static void vtexture_unlink(vtexture_t * vtexture, vtexture_page_t * page)
+{
+    int * link = &vtexture->hash[vtexture_hash(page->key)];
+    while (*link >= 0) {
+        if (&vtexture->pages[*link] == page) {
+            *link = page->hash_next;
+            break;
+        }
+
+        link = &vtexture->pages[*link].hash_next;
+    }
+
+    page->key = VTEXTURE_KEY_NONE;
+    page->hash_next = -1;
+    vtexture->resident_count--;
+}
+
+/*
+ * Returns 1 if the page is (or already was) resident, 0 on I/O error or when
+ * every evictable page has been used by the current frame.
+ */
+static int vtexture_load(vtexture_t * vtexture, uint32_t key, int pinned)
+{
+    vtexture_page_t * page = vtexture_lookup(vtexture, key);
+    if (page) {
+        page->last_used = vtexture->frame;
+
+        return 1;
+    }
+
+    const size_t level = key >> 28;
+    const size_t py = (key >> 14) & 0x3fff;
+    const size_t px = key & 0x3fff;
+
+    if (0
+        || level >= vtexture->mipmap_count
+        || px >= vtexture->level_pages_x[level]
+        || py >= vtexture->level_pages_y[level]
+    ) {
+        return 0;
+    }
+
+    /* least recently used page, free pages first */
+    size_t i;
+    for (i = 0; i < VTEXTURE_CACHE_PAGES; i++) {
+        vtexture_page_t * const candidate = &vtexture->pages[i];
+        if (candidate->pinned) {
+            continue;
+        }
+
+        if (candidate->key == VTEXTURE_KEY_NONE) {
+            page = candidate;
+            break;
+        }
+
+        if (!page || page->last_used > candidate->last_used) {
+            page = candidate;
+        }
+    }
+
+    if (!page || (page->key != VTEXTURE_KEY_NONE && page->last_used == vtexture->frame)) {
+        return 0;
+    }
+
+    if (page->key != VTEXTURE_KEY_NONE) {
+        vtexture_unlink(vtexture, page);
+    }
+
+    const size_t page_bytes = vtexture->page_size * vtexture->page_size;
+    const off_t offset = VTEXTURE_DATA_OFFSET
+        + (off_t) (vtexture->level_first_page[level] + py * vtexture->level_pages_x[level] + px) * page_bytes
+    ;
+
+    if (pread(vtexture->fd, page->data, page_bytes, offset) != (ssize_t) page_bytes) {
+        return 0;
+    }
+
+    const size_t bucket = vtexture_hash(key);
+    page->key = key;
+    page->last_used = vtexture->frame;
+    page->pinned = pinned;
+    page->hash_next = vtexture->hash[bucket];
+    vtexture->hash[bucket] = page - vtexture->pages;
+    vtexture->resident_count++;
+    vtexture->load_count++;
+
+    return 1;
+}
+
+vtexture_t * vtexture_open(const char * file_name)
+{
+    vtexture_t * vtexture = malloc(sizeof(*vtexture));
+    if (!vtexture) {
+        return NULL;
+    }
+
+    vtexture->page_data = NULL;
+    vtexture->fd = open(file_name, O_RDONLY);
+    if (vtexture->fd < 0) {
+        goto error;
+    }
+
+    uint8_t header[24 + sizeof(vtexture->colors)];
+    if (pread(vtexture->fd, header, sizeof(header), 0) != sizeof(header)) {
+        goto error;
+    }
+
+    vtexture->width = read_le32(header + 8);
+    vtexture->height = read_le32(header + 12);
+    vtexture->page_size = read_le32(header + 16);
+    vtexture->mipmap_count = read_le32(header + 20);
+    memcpy(vtexture->colors, header + 24, sizeof(vtexture->colors));
+
+    if (0
+        || memcmp(header, VTEXTURE_MAGIC, 8) != 0
+        || vtexture->page_size != VTEXTURE_PAGE_SIZE
+        || vtexture->mipmap_count < 1
+        || vtexture->mipmap_count > sizeof(vtexture->level_pages_x) / sizeof(vtexture->level_pages_x[0])
+        || vtexture->width >> (vtexture->mipmap_count - 1) == 0
+        || vtexture->height >> (vtexture->mipmap_count - 1) == 0
+        || vtexture->width > vtexture->page_size << 14
+        || vtexture->height > vtexture->page_size << 14
+    ) {
+        goto error;
+    }
+
+    size_t page_count = 0;
+    size_t i;
+    for (i = 0; i < vtexture->mipmap_count; i++) {
+        vtexture->level_pages_x[i] = ((vtexture->width >> i) + vtexture->page_size - 1) / vtexture->page_size;
+        vtexture->level_pages_y[i] = ((vtexture->height >> i) + vtexture->page_size - 1) / vtexture->page_size;
+        vtexture->level_first_page[i] = page_count;
+        page_count += vtexture->level_pages_x[i] * vtexture->level_pages_y[i];
+    }
+
+    struct stat st;
+    const size_t page_bytes = vtexture->page_size * vtexture->page_size;
+    if (fstat(vtexture->fd, &st) != 0 || (size_t) st.st_size < VTEXTURE_DATA_OFFSET + page_count * page_bytes) {
+        goto error;
+    }
+
+    vtexture->page_data = malloc(VTEXTURE_CACHE_PAGES * page_bytes);
+    if (!vtexture->page_data) {
+        goto error;
+    }
+
+    for (i = 0; i < VTEXTURE_CACHE_PAGES; i++) {
+        vtexture->pages[i].key = VTEXTURE_KEY_NONE;
+        vtexture->pages[i].last_used = 0;
+        vtexture->pages[i].pinned = 0;
+        vtexture->pages[i].hash_next = -1;
+        vtexture->pages[i].data = vtexture->page_data + i * page_bytes;
+    }
+
+    for (i = 0; i < VTEXTURE_HASH_SIZE; i++) {
+        vtexture->hash[i] = -1;
+    }
+
+    vtexture->request_count = 0;
+    vtexture->frame = 1;
+    vtexture->frame_load_count = 0;
+    vtexture->resident_count = 0;
+    vtexture->miss_count = 0;
+    vtexture->load_count = 0;
+
+    /* the coarsest level is pinned when small enough, as the last resort fallback */
+    const size_t coarsest = vtexture->mipmap_count - 1;
+    if (vtexture->level_pages_x[coarsest] * vtexture->level_pages_y[coarsest] <= VTEXTURE_CACHE_PAGES / 4) {
+        size_t px, py;
+        for (py = 0; py < vtexture->level_pages_y[coarsest]; py++) {
+            for (px = 0; px < vtexture->level_pages_x[coarsest]; px++) {
+                if (!vtexture_load(vtexture, VTEXTURE_KEY(coarsest, px, py), 1)) {
+                    goto error;
+                }
+            }
+        }
+    }
+
+    return vtexture;
+
+error:
+    vtexture_close(vtexture);
+
+    return NULL;
+}
+
+void vtexture_close(vtexture_t * vtexture)
+{
+    if (vtexture->fd >= 0) {
+        close(vtexture->fd);
+    }
+
+    free(vtexture->page_data);
+    free(vtexture);
+}
+
+void vtexture_cursor_init(vtexture_cursor_t * cursor)
+{
+    cursor->key = VTEXTURE_KEY_NONE;
+    cursor->missing_key = VTEXTURE_KEY_NONE;
+    cursor->page = NULL;
+}
+
+/* may be called concurrently by render threads */
+static void vtexture_request(vtexture_t * vtexture, uint32_t key)
+{
+    __atomic_fetch_add(&vtexture->miss_count, 1, __ATOMIC_RELAXED);
+
+    size_t request_count = __atomic_load_n(&vtexture->request_count, __ATOMIC_RELAXED);
+    if (request_count > VTEXTURE_REQUEST_CAPACITY) {
+        request_count = VTEXTURE_REQUEST_CAPACITY;
+    }
+
+    /* duplicates are still possible under contention, they are skipped at load time */
+    size_t i;
+    for (i = 0; i < request_count; i++) {
+        if (__atomic_load_n(&vtexture->requests[i], __ATOMIC_RELAXED) == key) {
+            return;
+        }
+    }
+
+    const size_t idx = __atomic_fetch_add(&vtexture->request_count, 1, __ATOMIC_RELAXED);
+    if (idx < VTEXTURE_REQUEST_CAPACITY) {
+        __atomic_store_n(&vtexture->requests[idx], key, __ATOMIC_RELAXED);
+    }
+}
+
+uint8_t vtexture_sample(vtexture_t * vtexture, vtexture_cursor_t * cursor, size_t level, float x, float y)
+{
+    const size_t page_size = vtexture->page_size;
+
+    /* missing pages fall back to coarser levels */
+    for (; level < vtexture->mipmap_count; level++) {
+        const size_t lx = (size_t) x >> level;
+        const size_t ly = (size_t) y >> level;
+        const uint32_t key = VTEXTURE_KEY(level, lx / page_size, ly / page_size);
+
+        if (key != cursor->key) {
+            if (key == cursor->missing_key) {
+                continue;
+            }
+
+            vtexture_page_t * const page = vtexture_lookup(vtexture, key);
+            if (!page) {
+                vtexture_request(vtexture, key);
+                cursor->missing_key = key;
+                continue;
+            }
+
+            __atomic_store_n(&page->last_used, vtexture->frame, __ATOMIC_RELAXED);
+            cursor->key = key;
+            cursor->page = page;
+        }
+
+        return cursor->page->data[(ly % page_size) * page_size + lx % page_size];
+    }
+
+    return 0;
+}
+
+/*
+ * To be called once per frame, after rendering. Loads the pages missed by
+ * the frame first, the remaining ones will be requested again.
+ */
+void vtexture_update(vtexture_t * vtexture)
+{
+    TRACE_ZONE("vtexture_update");
+
+    vtexture->frame++;
+    vtexture->frame_load_count = 0;
+
+    size_t request_count = vtexture->request_count;
+    if (request_count > VTEXTURE_REQUEST_CAPACITY) {
+        request_count = VTEXTURE_REQUEST_CAPACITY;
+    }
+
+    /* requested pages may have been loaded meanwhile, only reads count against the budget */
+    size_t i;
+    for (i = 0; i < request_count && vtexture->frame_load_count < VTEXTURE_LOADS_PER_FRAME; i++) {
+        const size_t load_count = vtexture->load_count;
+        if (!vtexture_load(vtexture, vtexture->requests[i], 0) || vtexture->load_count == load_count) {
+            continue;
+        }
+
+        vtexture->frame_load_count++;
+    }
+
+    vtexture->request_count = 0;
+}
+
+/*
+ * Prefetches the finest levels along the camera direction, with what remains
+ * of the frame load budget after vtexture_update().
+ */
+void vtexture_prefetch(vtexture_t * vtexture, vec2_t position, vec2_t direction)
+{
+    TRACE_ZONE("vtexture_prefetch");
+
+    size_t level;
+    for (level = 0; level < 2 && level < vtexture->mipmap_count; level++) {
+        const float step = (float) (vtexture->page_size << level);
+
+        size_t k;
+        for (k = 0; k < 4; k++) {
+            int dx, dy;
+            for (dy = -1; dy <= 1; dy++) {
+                for (dx = -1; dx <= 1; dx++) {
+                    const float x = wrap_repeat(position.x + direction.x * step * k + dx * step, 0, vtexture->width);
+                    const float y = wrap_repeat(position.y + direction.y * step * k + dy * step, 0, vtexture->height);
+                    const uint32_t key = VTEXTURE_KEY(
+                        level,
+                        ((size_t) x >> level) / vtexture->page_size,
+                        ((size_t) y >> level) / vtexture->page_size
+                    );
+
+                    if (vtexture_lookup(vtexture, key)) {
+                        vtexture_load(vtexture, key, 0);
+                        continue;
+                    }
+
+                    if (vtexture->frame_load_count >= VTEXTURE_LOADS_PER_FRAME || !vtexture_load(vtexture, key, 0)) {
+                        continue;
+                    }
+
+                    vtexture->frame_load_count++;
+                }
+            }
+        }
+    }
+}
+
+void mat3_identity(mat3_t * m)
+{
+    m->nums[0][0] = 1;
+    m->nums[0][1] = 0;
+    m->nums[0][2] = 0;
+
+    m->nums[1][0] = 0;
+    m->nums[1][1] = 1;
+    m->nums[1][2] = 0;
+
+    m->nums[2][0] = 0;
+    m->nums[2][1] = 0;
+    m->nums[2][2] = 1;
+}
+
+void mat3_copy(mat3_t * a, const mat3_t * b)
+{
+    memcpy(a, b, sizeof(*a));
+}
+
+void mat3_mult(mat3_t * a, const mat3_t * b)
+{
+    size_t i, j;
+    mat3_t res;
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) {
+            res.nums[i][j] = 0
+                + a->nums[i][0] * b->nums[0][j]
+                + a->nums[i][1] * b->nums[1][j]
+                + a->nums[i][2] * b->nums[2][j]
+            ;
+        }
+    }
+
+    mat3_copy(a, &res);
+}
+
+void mat3_translate(mat3_t * m, float x, float y)
+{
+    mat3_t transform_mat;
+    mat3_identity(&transform_mat);
+    transform_mat.nums[0][2] = x;
+    transform_mat.nums[1][2] = y;
+
+    mat3_mult(m, &transform_mat);
+}
+
+void mat3_scale(mat3_t * m, float x, float y)
+{
+    mat3_t transform_mat;
+    mat3_identity(&transform_mat);
+    transform_mat.nums[0][0] = x;
+    transform_mat.nums[1][1] = y;
+
+    mat3_mult(m, &transform_mat);
+}
+
+void mat3_rotate(mat3_t * m, float x)
+{
+    const float cos = cosf(x);
+    const float sin = sinf(x);
+    mat3_t transform_mat;
+    mat3_identity(&transform_mat);
+    transform_mat.nums[0][0] = cos;
+    transform_mat.nums[0][1] = -sin;
+    transform_mat.nums[1][0] = sin;
+    transform_mat.nums[1][1] = cos;
+
+    mat3_mult(m, &transform_mat);
+}
+
+void mat3_transform(const mat3_t * m, vec2_t * v)
+{
+    const float x = 0
+        + m->nums[0][0] * v->x
+        + m->nums[0][1] * v->y
+        + m->nums[0][2]
+    ;
+
+    v->y = 0
+        + m->nums[1][0] * v->x
+        + m->nums[1][1] * v->y
+        + m->nums[1][2]
+    ;
+
+    v->x = x;
+}
+
+float wrap_repeat(float v, float min, float max)
+{
+    v -= min;
+    v = fmod(v, max - min);
+    v += min;
+
+    if (v < min) {
+        v += max - min;
+    }
+
+    return v;
+}
+
+void scanline_table_init(scanline_table_t * table)
+{
+    table->width = 0;
+    table->height = 0;
+    table->subsamples_x = 1;
+    table->subsamples_y = 1;
+    table->perspective = -1;
+    table->mipmap_count = 0;
+    table->scanlines = NULL;
+    table->capacity = 0;
+    table->effect = NULL;
+}
+
+/* perspective scale factor of a row, in cells */
+static vec2_t scanline_scale(float row, size_t cell_width, size_t cell_height, int perspective)
+{
+    vec2_t scale = {30, 30};
+    if (!perspective) {
+        return scale;
+    }
+
+    /*
+     * This formula should be rewrote, simplified and parametrized (fov, perspective angle)
+     */
+    scale.x = cell_width / (row + 1.f);
+    scale.y = (((row + 1.f) / cell_height) + 3 * cell_width / cell_height)
+        / ((row + 1.f) / cell_height)
+    ;
+
+    return scale;
+}
+
+int scanline_table_update(
+    scanline_table_t * table,
+    size_t width,
+    size_t height,
+    size_t subsamples_x,
+    size_t subsamples_y,
+    int perspective,
+    size_t mipmap_count
+) {
+    if (1
+        && table->scanlines
+        && table->width == width
+        && table->height == height
+        && table->subsamples_x == subsamples_x
+        && table->subsamples_y == subsamples_y
+        && table->perspective == perspective
+        && table->mipmap_count == mipmap_count
+    ) {
+        return 1;
+    }
+
+    if (table->capacity < height || !table->scanlines) {
+        scanline_t * scanlines = realloc(table->scanlines, (height ? height : 1) * sizeof(*scanlines));
+        if (!scanlines) {
+            return 0;
+        }
+
+        table->scanlines = scanlines;
+        table->capacity = height ? height : 1;
+    }
+
+    table->width = width;
+    table->height = height;
+    table->subsamples_x = subsamples_x;
+    table->subsamples_y = subsamples_y;
+    table->perspective = perspective;
+    table->mipmap_count = mipmap_count;
+
+    /* projection geometry in cells, samples are taken at their center within cells */
+    const size_t cell_width = width / subsamples_x;
+    const size_t cell_height = height / subsamples_y;
+    table->center.x = cell_width / 2.f;
+    table->center.y = cell_height * 0.8;
+
+    size_t i;
+    for (i = 0; i < height; i++) {
+        scanline_t * const scanline = &table->scanlines[i];
+        const float row = (i + 0.5f) / subsamples_y - 0.5f;
+        const float next_row = row + 1.f / subsamples_y;
+        const vec2_t next_scale = scanline_scale(next_row, cell_width, cell_height, perspective);
+
+        scanline->scale = scanline_scale(row, cell_width, cell_height, perspective);
+        scanline->origin.x = (0.5f / subsamples_x - 0.5f - table->center.x) * subsamples_x;
+        scanline->origin.y = row - table->center.y;
+        scanline->scale.x /= subsamples_x;
+
+        /* distance to the next sample along the row and to the next row, on the center column */
+        scanline->footprint.x = scanline->scale.x;
+        scanline->footprint.y = fabsf(
+            next_scale.y * (next_row - table->center.y) - scanline->scale.y * scanline->origin.y
+        );
+    }
+
+    return 1;
+}
+
+void scanline_table_destroy(scanline_table_t * table)
+{
+    free(table->scanlines);
+    scanline_table_init(table);
+}
+
+void scanline_effect_wave(scanline_t * scanline, size_t y, size_t height, size_t frame)
+{
+    /* horizontal heat-haze like wave, stronger near the horizon */
+    scanline->origin.x += 3 * (1 - y / (float) height) * sinf(y * 0.4f + frame * 0.15f);
+}
+
+/* mipmap level of a row, from its footprint with the camera zoom applied */
+size_t scanline_mipmap_level(const scanline_t * scanline, vec2_t camera_scale, size_t mipmap_count)
+{
+    return mipmap_level_select(
+        fmaxf(
+            fabsf(camera_scale.x) * scanline->footprint.x,
+            fabsf(camera_scale.y) * scanline->footprint.y
+        ),
+        mipmap_count
+    );
+}
+
+/*
+ * Nearest level for a footprint in level 0 texels, as GL_NEAREST_MIPMAP_NEAREST: level 0
+ * when magnified, then the level whose texels are closest to the footprint (log2 rounded).
+ */
+size_t mipmap_level_select(float footprint, size_t mipmap_count)
+{
+    if (!(footprint > 1) || mipmap_count == 0) {
+        return 0;
+    }
+
+    const float lod = log2f(footprint) + 0.5f;
+    if (lod >= mipmap_count - 1) {
+        return mipmap_count - 1;
+    }
+
+    return (size_t) lod;
+}
+
+void palette_shadow_init(palette_shadow_t * shadow)
+{
+    memset(shadow->color_known, 0, sizeof(shadow->color_known));
+    memset(shadow->pair_known, 0, sizeof(shadow->pair_known));
+    shadow->upload_count = 0;
+}
+
+void palette_shadow_color(palette_shadow_t * shadow, size_t idx, short r, short g, short b)
+{
+    if (idx < sizeof(shadow->colors) / sizeof(shadow->colors[0])) {
+        short * const color = shadow->colors[idx];
+        if (1
+            && shadow->color_known[idx]
+            && color[0] == r
+            && color[1] == g
+            && color[2] == b
+        ) {
+            return;
+        }
+
+        color[0] = r;
+        color[1] = g;
+        color[2] = b;
+        shadow->color_known[idx] = 1;
+    }
+
+    init_color(idx, r, g, b);
+    shadow->upload_count++;
+}
+
+void palette_shadow_pair(palette_shadow_t * shadow, size_t idx, short fg, short bg)
+{
+    if (idx < PALETTE_SHADOW_PAIRS) {
+        short * const pair = shadow->pairs[idx];
+        if (1
+            && shadow->pair_known[idx]
+            && pair[0] == fg
+            && pair[1] == bg
+        ) {
+            return;
+        }
+
+        pair[0] = fg;
+        pair[1] = bg;
+        shadow->pair_known[idx] = 1;
+    }
+
+    init_pair(idx, fg, bg);
+    shadow->upload_count++;
+}
+
+void palette_cycle(uint8_t colors[][4], const uint8_t * indices, size_t count, size_t phase, uint8_t cycled[][4])
+{
+    memcpy(cycled, colors, 256 * sizeof(colors[0]));
+
+    size_t i;
+    for (i = 0; i < count; i++) {
+        memcpy(cycled[indices[i]], colors[indices[(i + phase) % count]], sizeof(colors[0]));
+    }
+}
+
+void renderer_context_init(
+    renderer_context_t * context,
+    const renderer_t * renderer,
+    WINDOW * window,
+    palette_shadow_t * palette
+) {
+    context->renderer = renderer;
+    context->window = window;
+    context->palette = palette;
+    context->last_color_idx = -1;
+    memset(context->color_dots, 0, sizeof(context->color_dots));
+}
+
+static void renderer256_init(renderer_context_t * context, uint8_t colors[][4])
+{
+    context->last_color_idx = -1;
+
+    size_t i;
+    for (i = 0; i < 256; i++) {
+        palette_shadow_pair(context->palette, i + 1, COLOR_BLACK, i);
+    }
+
+    for (i = 0; i < 256; i++) {
+        palette_shadow_color(
+            context->palette,
+            i,
+            (1000 * colors[i][0]) / 255,
+            (1000 * colors[i][1]) / 255,
+            (1000 * colors[i][2]) / 255
+        );
+    }
+}
+
+static void renderer256_draw(renderer_context_t * context, size_t x, size_t y, uint8_t colors[][4], uint8_t color_idx)
+{
+    if (context->last_color_idx != color_idx) {
+        context->last_color_idx = color_idx;
+        wattron(context->window, COLOR_PAIR(color_idx + 1));
+    }
+
+    mvwaddch(context->window, y, x, ' ');
+}
+
+static void renderer16_init(renderer_context_t * context, uint8_t colors[][4])
+{
+    const int available_colors[] = {
+        COLOR_BLACK,   /* 000 -> 0 */
+        COLOR_BLUE,    /* 001 -> 1 */
+        COLOR_GREEN,   /* 010 -> 2 */
+        COLOR_CYAN,    /* 011 -> 3 */
+        COLOR_RED,     /* 100 -> 4 */
+        COLOR_MAGENTA, /* 101 -> 5 */
+        COLOR_YELLOW,  /* 110 -> 6 */
+        COLOR_WHITE,   /* 111 -> 7 */
+    };
+
+    const size_t available_color_count = sizeof(available_colors) / sizeof(available_colors[0]);
+
+    size_t i;
+    for (i = 0; i < available_color_count; i++) {
+        palette_shadow_pair(context->palette, i + 1, available_colors[i], COLOR_BLACK);
+    }
+}
+
+static void renderer16_draw(renderer_context_t * context, size_t x, size_t y, uint8_t colors[][4], uint8_t color_idx)
+{
+    const int available_colors[] = {
+        COLOR_BLACK,   /* 000 -> 0 */
+        COLOR_BLUE,    /* 001 -> 1 */
+        COLOR_GREEN,   /* 010 -> 2 */
+        COLOR_CYAN,    /* 011 -> 3 */
+        COLOR_RED,     /* 100 -> 4 */
+        COLOR_MAGENTA, /* 101 -> 5 */
+        COLOR_YELLOW,  /* 110 -> 6 */
+        COLOR_WHITE,   /* 111 -> 7 */
+    };
+
+    const size_t available_color_count = sizeof(available_colors) / sizeof(available_colors[0]);
+
+    const uint8_t * color = colors[color_idx];
+
+    int lum = 0;
+    int max_comp = 0;
+    size_t i;
+    for (i = 0; i < 3; i++) {
+        if (max_comp < color[i]) {
+            max_comp = color[i];
+        }
+
+        const int comp_lum = roundf(color[i] / (255.f / 4));
+        if (lum < comp_lum) {
+            lum = comp_lum;
+        }
+    }
+
+    int normalized_color = 0
+        | (color[0] / (float) max_comp > 0.75 ? 1 : 0) << 2
+        | (color[1] / (float) max_comp > 0.75 ? 1 : 0) << 1
+        | (color[2] / (float) max_comp > 0.75 ? 1 : 0) << 0
+    ;
+
+    if (lum == 0) {
+        normalized_color = 0;
+    }
+
+    wattrset(context->window, (lum <= 2 ? A_NORMAL : A_BOLD) | A_REVERSE);
+    wattron(context->window, COLOR_PAIR(normalized_color + 1));
+    mvwaddch(context->window, y, x, ' ');
+}
+
+static void renderer1_init(renderer_context_t * context, uint8_t colors[][4])
+{
+}
+
+static void renderer1_draw(renderer_context_t * context, size_t x, size_t y, uint8_t colors[][4], uint8_t color_idx)
+{
+    const char charset[] = " .`^*:;+=%§$#";
+    const size_t charset_size = sizeof(charset) -1;
+
+    const uint8_t * color = colors[color_idx];
+    int lum = 0;
+    size_t i;
+    for (i = 0; i < 3; i++) {
+        const int comp_lum = roundf(color[i] / (255.f / charset_size));
+        if (lum < comp_lum) {
+            lum = comp_lum;
+        }
+    }
+
+    if (lum >= charset_size) {
+        lum = charset_size - 1;
+    }
+
+    mvwaddch(context->window, y, x, charset[lum]);
+}
+
+/*
+ * Braille dots of a cell, 2 columns and 4 rows, as bits of the U+2800 block:
+ *   1 4
+ *   2 5
+ *   3 6
+ *   7 8
+ */
+static const uint8_t braille_dot_bits[4][2] = {
+    {0x01, 0x08},
+    {0x02, 0x10},
+    {0x04, 0x20},
+    {0x40, 0x80},
+};
+
+/* 2x4 ordered dithering thresholds, ranks out of 8 */
+static const uint8_t braille_dither_ranks[4][2] = {
+    {0, 4},
+    {6, 2},
+    {1, 5},
+    {7, 3},
+};
+
+/* draws a framebuffer with one cell per block, returns the number of cells drawn */
+size_t renderer_draw_framebuffer(
+    renderer_context_t * context,
+    const framebuffer_t * framebuffer,
+    uint8_t colors[][4],
+    size_t frame
+) {
+    const renderer_t * const renderer = context->renderer;
+    const size_t width = framebuffer->width / renderer->block_width;
+    const size_t height = framebuffer->height / renderer->block_height;
+    size_t drawn_count = 0;
+    size_t x, y;
+
+    if (renderer->draw_block) {
+        for (y = 0; y < height; y++) {
+            const uint8_t * const row = framebuffer->data + y * renderer->block_height * framebuffer->width;
+            for (x = 0; x < width; x++) {
+                renderer->draw_block(context, x, y, row + x * renderer->block_width, framebuffer->width);
+                drawn_count++;
+            }
+        }
+
+        return drawn_count;
+    }
+
+    for (y = 0; y < height; y++) {
+        const uint8_t * const row = framebuffer->data + y * framebuffer->width;
+        for (x = 0; x < width; x++) {
+            const uint8_t color_idx = row[x];
+            if ((color_idx + frame) % 13) {
+                continue;
+            }
+
+            renderer->draw(context, x, y, colors, color_idx);
+            drawn_count++;
+        }
+    }
+
+    return drawn_count;
+}
+
+size_t renderer_draw_rect(
+    renderer_context_t * context,
+    const framebuffer_t * framebuffer,
+    uint8_t colors[][4],
+    size_t x,
+    size_t y,
+    size_t width,
+    size_t height
+) {
+    const renderer_t * const renderer = context->renderer;
+    size_t drawn_count = 0;
+    size_t cx, cy;
+
+    for (cy = y; cy < y + height; cy++) {
+        const uint8_t * const row = framebuffer->data + cy * renderer->block_height * framebuffer->width;
+        for (cx = x; cx < x + width; cx++) {
+            if (renderer->draw_block) {
+                renderer->draw_block(context, cx, cy, row + cx * renderer->block_width, framebuffer->width);
+            } else {
+                renderer->draw(context, cx, cy, colors, row[cx]);
+            }
+
+            drawn_count++;
+        }
+    }
+
+    return drawn_count;
+}
+
+void renderer_shift(
+    renderer_context_t * context,
+    size_t x,
+    size_t y,
+    size_t width,
+    size_t height,
+    long dx,
+    long dy
+) {
+    WINDOW * const window = context->window;
+
+    if (dy && height > 0) {
+        /* the window scroll region and scrolling flag are restored */
+        int top = 0;
+        int bottom = getmaxy(window) - 1;
+        if (wgetscrreg(window, &top, &bottom) != OK) {
+            top = 0;
+            bottom = getmaxy(window) - 1;
+        }
+
+        const bool scroll = is_scrollok(window);
+        wsetscrreg(window, y, y + height - 1);
+        scrollok(window, TRUE);
+        wscrl(window, dy);
+        scrollok(window, scroll);
+        wsetscrreg(window, top, bottom);
+    }
+
+    if (!dx || width == 0) {
+        return;
+    }
+
+    /* copied cells keep their own rendition, not the one renderers left on the window */
+    attr_t attrs;
+    short pair;
+    wattr_get(window, &attrs, &pair, NULL);
+    wattr_set(window, A_NORMAL, 0, NULL);
+
+    size_t cx, cy;
+    for (cy = y; cy < y + height; cy++) {
+        for (cx = 0; cx < width; cx++) {
+            /* in copy order, so that sources are read before being overwritten */
+            const size_t dst = x + (dx > 0 ? cx : width - 1 - cx);
+            const long src = (long) dst + dx;
+            if (src < (long) x || src >= (long) (x + width)) {
+                continue;
+            }
+
+            cchar_t cell;
+            mvwin_wch(window, cy, src, &cell);
+            mvwadd_wch(window, cy, dst, &cell);
+        }
+    }
+
+    wattr_set(window, attrs, pair, NULL);
+}
+
+static void renderer_braille_init(renderer_context_t * context, uint8_t colors[][4])
+{
+    float lums[256];
+    float min_lum = FLT_MAX;
+    float max_lum = 0;
+    size_t i, dx, dy;
+
+    for (i = 0; i < 256; i++) {
+        lums[i] = 0.299f * colors[i][0] + 0.587f * colors[i][1] + 0.114f * colors[i][2];
+        if (min_lum > lums[i]) {
+            min_lum = lums[i];
+        }
+
+        if (max_lum < lums[i]) {
+            max_lum = lums[i];
+        }
+    }
+
+    /* stretched over the palette luminance range, for contrast */
+    const float lum_range = max_lum > min_lum ? max_lum - min_lum : 1;
+
+    for (i = 0; i < 256; i++) {
+        const float lum = (lums[i] - min_lum) / lum_range;
+
+        context->color_dots[i] = 0;
+        for (dy = 0; dy < 4; dy++) {
+            for (dx = 0; dx < 2; dx++) {
+                if (lum > (braille_dither_ranks[dy][dx] + 0.5f) / 8) {
+                    context->color_dots[i] |= braille_dot_bits[dy][dx];
+                }
+            }
+        }
+    }
+}
+
+static void renderer_braille_put(WINDOW * window, size_t x, size_t y, uint8_t dots)
+{
+    const wchar_t glyph[2] = {0x2800 + dots, 0};
+    cchar_t cell;
+
+    setcchar(&cell, glyph, A_NORMAL, 0, NULL);
+    mvwadd_wch(window, y, x, &cell);
+}
+
+static void renderer_braille_draw(renderer_context_t * context, size_t x, size_t y, uint8_t colors[][4], uint8_t color_idx)
+{
+    wattrset(context->window, A_NORMAL);
+    renderer_braille_put(context->window, x, y, context->color_dots[color_idx]);
+}
+
+static void renderer_braille_draw_block(renderer_context_t * context, size_t x, size_t y, const uint8_t * texels, size_t stride)
+{
+    uint8_t dots = 0;
+    size_t dx, dy;
+    for (dy = 0; dy < 4; dy++) {
+        for (dx = 0; dx < 2; dx++) {
+            dots |= context->color_dots[texels[dy * stride + dx]] & braille_dot_bits[dy][dx];
+        }
+    }
+
+    renderer_braille_put(context->window, x, y, dots);
+}
+
+void palette_backup_save(palette_backup_t * backup)
+{
+    backup->color_count = sizeof(backup->colors) / sizeof(backup->colors[0]);
+    if (backup->color_count > COLORS) {
+        backup->color_count = COLORS;
+    }
+
+    backup->pair_count = sizeof(backup->pairs) / sizeof(backup->pairs[0]);
+    if (backup->pair_count > COLOR_PAIRS) {
+        backup->pair_count = COLOR_PAIRS;
+    }
+
+    size_t i;
+    for (i = 0; i < backup->color_count; i++) {
+        color_content(
+            i,
+            &backup->colors[i][0],
+            &backup->colors[i][1],
+            &backup->colors[i][2]
+        );
+    }
+
+    for (i = 0; i < backup->pair_count; i++) {
+        pair_content(
+            i,
+            &backup->pairs[i][0],
+            &backup->pairs[i][1]
+        );
+    }
+
+    backup->saved = 1;
+}
+
+void palette_backup_restore(const palette_backup_t * backup, palette_shadow_t * shadow)
+{
+    if (!backup->saved) {
+        return;
+    }
+
+    /* entries the shadow does not know about were never changed */
+    size_t i;
+    for (i = 0; i < backup->color_count; i++) {
+        if (shadow->color_known[i]) {
+            palette_shadow_color(
+                shadow,
+                i,
+                backup->colors[i][0],
+                backup->colors[i][1],
+                backup->colors[i][2]
+            );
+        }
+    }
+
+    for (i = 0; i < backup->pair_count; i++) {
+        if (shadow->pair_known[i]) {
+            palette_shadow_pair(
+                shadow,
+                i,
+                backup->pairs[i][0],
+                backup->pairs[i][1]
+            );
+        }
+    }
+}
+
+size_t current_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+void accelerator_init(accelerator_t * accelerator, float acceleration, float deceleration, float max)
+{
+    accelerator->acceleration = acceleration;
+    accelerator->deceleration = deceleration;
+    accelerator->max = max;
+    accelerator->active = 0;
+    accelerator->reverse = 0;
+    accelerator->velocity = 0;
+}
+
+void accelerator_press(accelerator_t * accelerator, int reverse)
+{
+    accelerator->active = 1;
+    accelerator->reverse = reverse;
+}
+
+void accelerator_release(accelerator_t * accelerator)
+{
+    accelerator->active = 0;
+}
+
+float accelerator_step(accelerator_t * accelerator, float time)
+{
+    const float distance = accelerator->velocity * time;
+
+    const int dir = accelerator->reverse ? -1 : 1;
+
+    if (accelerator->active) {
+        accelerator->velocity += dir * accelerator->acceleration * time;
+        if (dir * accelerator->velocity > accelerator->max) {
+            accelerator->velocity = dir * accelerator->max;
+        }
+    } else if (accelerator->velocity != 0) {
+        accelerator->velocity -= dir * accelerator->deceleration * time;
+        if (dir * accelerator->velocity < 0) {
+            accelerator->velocity = 0;
+        }
+    }
+
+    return distance;
+}
+
+float accelerator_velocity(const accelerator_t * accelerator)
+{
+    return accelerator->velocity;
+}
+
+void camera_init(camera_t * camera, vec2_t position, vec2_t scale, float orientation)
+{
+    camera->position = position;
+    camera->scale = scale;
+    camera->orientation = orientation;
+    accelerator_init(&camera->move_accelerator, 600, 150, 150);
+    accelerator_init(&camera->turn_accelerator, M_PI * 0.3, M_PI * 8, M_PI * 0.8);
+}
+
+void camera_step(camera_t * camera, float time)
+{
+    const float move_distance = accelerator_step(&camera->move_accelerator, time);
+    camera->position.y -= move_distance * cosf(camera->orientation);
+    camera->position.x += move_distance * sinf(camera->orientation);
+
+    camera->orientation += accelerator_step(&camera->turn_accelerator, time);
+}
+
+/* blends two consecutive simulation states, alpha in [0, 1] */
+void camera_interpolate(const camera_t * previous, const camera_t * next, float alpha, camera_t * interpolated)
+{
+    *interpolated = *next;
+
+    interpolated->position.x = previous->position.x + (next->position.x - previous->position.x) * alpha;
+    interpolated->position.y = previous->position.y + (next->position.y - previous->position.y) * alpha;
+    interpolated->scale.x = previous->scale.x + (next->scale.x - previous->scale.x) * alpha;
+    interpolated->scale.y = previous->scale.y + (next->scale.y - previous->scale.y) * alpha;
+    interpolated->orientation = previous->orientation + (next->orientation - previous->orientation) * alpha;
+
+    interpolated->move_accelerator.velocity = previous->move_accelerator.velocity
+        + (next->move_accelerator.velocity - previous->move_accelerator.velocity) * alpha;
+    interpolated->turn_accelerator.velocity = previous->turn_accelerator.velocity
+        + (next->turn_accelerator.velocity - previous->turn_accelerator.velocity) * alpha;
+}
+
+/* extrapolates the camera `time` seconds ahead, at constant velocities */
+void camera_predict(const camera_t * camera, float time, camera_t * predicted)
+{
+    *predicted = *camera;
+
+    const float turn = accelerator_velocity(&camera->turn_accelerator) * time;
+    const float move = accelerator_velocity(&camera->move_accelerator) * time;
+    const float mid_orientation = camera->orientation + turn / 2;
+
+    predicted->orientation += turn;
+    predicted->position.y -= move * cosf(mid_orientation);
+    predicted->position.x += move * sinf(mid_orientation);
+}
+
+void framebuffer_init(framebuffer_t * framebuffer)
+{
+    framebuffer->width = 0;
+    framebuffer->height = 0;
+    framebuffer->data = NULL;
+}
+
+int framebuffer_resize(framebuffer_t * framebuffer, size_t width, size_t height)
+{
+    if (framebuffer->data && framebuffer->width == width && framebuffer->height == height) {
+        return 1;
+    }
+
+    uint8_t * data = realloc(framebuffer->data, width * height > 0 ? width * height : 1);
+    if (!data) {
+        return 0;
+    }
+
+    memset(data, 0, width * height);
+    framebuffer->data = data;
+    framebuffer->width = width;
+    framebuffer->height = height;
+
+    return 1;
+}
+
+void framebuffer_destroy(framebuffer_t * framebuffer)
+{
+    free(framebuffer->data);
+    framebuffer_init(framebuffer);
+}
+
+void overlay_init(overlay_t * overlay)
+{
+    overlay->x = 0;
+    overlay->y = 0;
+    overlay->dirty_count = 0;
+    framebuffer_init(&overlay->buffer);
+}
+
+/* the content is cleared and fully dirty once resized */
+int overlay_resize(overlay_t * overlay, size_t width, size_t height)
+{
+    if (overlay->buffer.data && overlay->buffer.width == width && overlay->buffer.height == height) {
+        return 1;
+    }
+
+    if (!framebuffer_resize(&overlay->buffer, width, height)) {
+        return 0;
+    }
+
+    overlay_invalidate_all(overlay);
+
+    return 1;
+}
+
+void overlay_destroy(overlay_t * overlay)
+{
+    framebuffer_destroy(&overlay->buffer);
+    overlay_init(overlay);
+}
+
+/* adds a rectangle, relative to the overlay, merged with the ones it touches */
+void overlay_invalidate(overlay_t * overlay, size_t x, size_t y, size_t width, size_t height)
+{
+    if (x >= overlay->buffer.width || y >= overlay->buffer.height) {
+        return;
+    }
+
+    if (width > overlay->buffer.width - x) {
+        width = overlay->buffer.width - x;
+    }
+
+    if (height > overlay->buffer.height - y) {
+        height = overlay->buffer.height - y;
+    }
+
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    size_t i;
+    for (i = 0; i < overlay->dirty_count; i++) {
+        const overlay_rect_t * const rect = &overlay->dirty[i];
+        if (1
+            && x <= rect->x + rect->width
+            && rect->x <= x + width
+            && y <= rect->y + rect->height
+            && rect->y <= y + height
+        ) {
+            break;
+        }
+    }
+
+    if (i == overlay->dirty_count && overlay->dirty_count < OVERLAY_DIRTY_RECTS) {
+        overlay_rect_t * const rect = &overlay->dirty[overlay->dirty_count++];
+        rect->x = x;
+        rect->y = y;
+        rect->width = width;
+        rect->height = height;
+
+        return;
+    }
+
+    /* grows the rectangle it touches, or the last one when there is no room left */
+    overlay_rect_t * const rect = &overlay->dirty[i < overlay->dirty_count ? i : overlay->dirty_count - 1];
+    const size_t x1 = rect->x + rect->width > x + width ? rect->x + rect->width : x + width;
+    const size_t y1 = rect->y + rect->height > y + height ? rect->y + rect->height : y + height;
+    rect->x = rect->x < x ? rect->x : x;
+    rect->y = rect->y < y ? rect->y : y;
+    rect->width = x1 - rect->x;
+    rect->height = y1 - rect->y;
+}
+
+void overlay_invalidate_all(overlay_t * overlay)
+{
+    overlay->dirty_count = 0;
+    overlay_invalidate(overlay, 0, 0, overlay->buffer.width, overlay->buffer.height);
+}
+
+/* copies the overlay over the framebuffer, clipped */
+void overlay_composite(const overlay_t * overlay, framebuffer_t * framebuffer)
+{
+    if (overlay->x >= framebuffer->width || overlay->y >= framebuffer->height) {
+        return;
+    }
+
+    const size_t width = overlay->buffer.width < framebuffer->width - overlay->x
+        ? overlay->buffer.width
+        : framebuffer->width - overlay->x
+    ;
+
+    size_t y;
+    for (y = 0; y < overlay->buffer.height && overlay->y + y < framebuffer->height; y++) {
+        memcpy(
+            framebuffer->data + (overlay->y + y) * framebuffer->width + overlay->x,
+            overlay->buffer.data + y * overlay->buffer.width,
+            width
+        );
+    }
+}
+
+/*
+ * Draws the cells covered by dirty rectangles from the framebuffer, which the overlay has
+ * been composited into, and forgets them. Returns the number of cells drawn.
+ */
+size_t overlay_draw_dirty(
+    overlay_t * overlay,
+    renderer_context_t * context,
+    const framebuffer_t * framebuffer,
+    uint8_t colors[][4]
+) {
+    const size_t block_width = context->renderer->block_width;
+    const size_t block_height = context->renderer->block_height;
+    const size_t cell_width = framebuffer->width / block_width;
+    const size_t cell_height = framebuffer->height / block_height;
+    size_t drawn_count = 0;
+
+    size_t i;
+    for (i = 0; i < overlay->dirty_count; i++) {
+        const overlay_rect_t * const rect = &overlay->dirty[i];
+        const size_t x0 = (overlay->x + rect->x) / block_width;
+        const size_t y0 = (overlay->y + rect->y) / block_height;
+        size_t x1 = (overlay->x + rect->x + rect->width + block_width - 1) / block_width;
+        size_t y1 = (overlay->y + rect->y + rect->height + block_height - 1) / block_height;
+
+        x1 = x1 < cell_width ? x1 : cell_width;
+        y1 = y1 < cell_height ? y1 : cell_height;
+        if (x0 >= x1 || y0 >= y1) {
+            continue;
+        }
+
+        drawn_count += renderer_draw_rect(context, framebuffer, colors, x0, y0, x1 - x0, y1 - y0);
+    }
+
+    overlay->dirty_count = 0;
+
+    return drawn_count;
+}
+
+void viewport_render_row(
+    const viewport_t * viewport,
+    size_t y,
+    const sampler_t * sampler,
+    size_t frame,
+    framebuffer_t * framebuffer
+) {
+    viewport_render_span(viewport, y, 0, viewport->width, sampler, frame, framebuffer);
+}
+
+void viewport_render_span(
+    const viewport_t * viewport,
+    size_t y,
+    size_t x_begin,
+    size_t x_end,
+    const sampler_t * sampler,
+    size_t frame,
+    framebuffer_t * framebuffer
+) {
+    const camera_t * const camera = viewport->camera;
+    const scanline_table_t * const table = &viewport->scanline_table;
+
+    scanline_t scanline = table->scanlines[y];
+    if (table->effect) {
+        table->effect(&scanline, y, table->height, frame);
+    }
+
+    const float orientation = camera->orientation + viewport->orientation_offset;
+    const float orientation_cos = cosf(orientation);
+    const float orientation_sin = sinf(orientation);
+
+    /*
+     * Equivalent to the view matrix
+     *   T(position) * T(center) * R(orientation) * S(scale * perspective) * T(-center)
+     * applied to (x, y), factorized as row origin + x * column step.
+     */
+    const float sx = camera->scale.x * scanline.scale.x;
+    const float sy = camera->scale.y * scanline.scale.y;
+    const vec2_t step = {
+        orientation_cos * sx,
+        orientation_sin * sx
+    };
+
+    vec2_t tx = {
+        camera->position.x + table->center.x
+            + orientation_cos * sx * scanline.origin.x - orientation_sin * sy * scanline.origin.y,
+        camera->position.y + table->center.y
+            + orientation_sin * sx * scanline.origin.x + orientation_cos * sy * scanline.origin.y
+    };
+
+    const texture_t * const texture = sampler->texture;
+    vtexture_t * const vtexture = sampler->vtexture;
+    const size_t mipmap_idx = scanline_mipmap_level(&scanline, camera->scale, table->mipmap_count);
+    const texture_mimap_t * const mipmap = texture ? texture_level(texture, mipmap_idx) : NULL;
+    vtexture_cursor_t cursor;
+    vtexture_cursor_init(&cursor);
+
+    uint8_t * const row = framebuffer->data + (viewport->y + y) * framebuffer->width + viewport->x;
+
+    /* still loading */
+    if (texture && !mipmap) {
+        memset(row + x_begin, 0, x_end - x_begin);
+        return;
+    }
+
+    /* columns before the span are stepped over, so that coordinates match whole rows */
+    size_t x;
+    for (x = 0; x < x_end; x++, tx.x += step.x, tx.y += step.y) {
+        if (x < x_begin) {
+            continue;
+        }
+
+        vec2_t stx = tx;
+
+        if (vtexture) {
+            if (0
+                || !(0 <= stx.x && stx.x < vtexture->width)
+                || !(0 <= stx.y && stx.y < vtexture->height)
+            ) {
+                stx.x = wrap_repeat(stx.x, 0, vtexture->width);
+                stx.y = wrap_repeat(stx.y, 0, vtexture->height);
+            }
+
+            row[x] = vtexture_sample(vtexture, &cursor, mipmap_idx, stx.x, stx.y);
+
+            continue;
+        }
+
+        if (0
+            || !(0 <= stx.x && stx.x < texture->width)
+            || !(0 <= stx.y && stx.y < texture->height)
+        ) {
+            stx.x = wrap_repeat(
+                stx.x,
+                sampler->padding_box_pos.x,
+                sampler->padding_box_pos.x + sampler->padding_box_size - 1
+            );
+
+            stx.y = wrap_repeat(
+                stx.y,
+                sampler->padding_box_pos.y,
+                sampler->padding_box_pos.y + sampler->padding_box_size - 1
+            );
+        }
+
+        stx.x /= mipmap->ratio;
+        stx.y /= mipmap->ratio;
+
+        row[x] = texture_texel(texture, mipmap, stx.x, stx.y);
+    }
+}
+
+/* view axes and cell size in texels, as applied by viewport_render_row() */
+static void viewport_cell_axes(const viewport_t * viewport, const camera_t * camera, vec2_t * axis_x, vec2_t * axis_y)
+{
+    const scanline_table_t * const table = &viewport->scanline_table;
+    const float orientation = camera->orientation + viewport->orientation_offset;
+    const float cell_x = camera->scale.x * table->scanlines[0].scale.x * table->subsamples_x;
+    const float cell_y = camera->scale.y * table->scanlines[0].scale.y;
+
+    axis_x->x = cosf(orientation) * cell_x;
+    axis_x->y = sinf(orientation) * cell_x;
+    axis_y->x = -sinf(orientation) * cell_y;
+    axis_y->y = cosf(orientation) * cell_y;
+}
+
+void viewport_snap_camera(const viewport_t * viewport, camera_t * camera)
+{
+    const scanline_table_t * const table = &viewport->scanline_table;
+    if (table->perspective || !table->scanlines || table->height == 0) {
+        return;
+    }
+
+    vec2_t axis_x, axis_y;
+    viewport_cell_axes(viewport, camera, &axis_x, &axis_y);
+
+    const float u = roundf(
+        (camera->position.x * axis_x.x + camera->position.y * axis_x.y)
+            / (axis_x.x * axis_x.x + axis_x.y * axis_x.y)
+    );
+
+    const float v = roundf(
+        (camera->position.x * axis_y.x + camera->position.y * axis_y.y)
+            / (axis_y.x * axis_y.x + axis_y.y * axis_y.y)
+    );
+
+    camera->position.x = u * axis_x.x + v * axis_y.x;
+    camera->position.y = u * axis_x.y + v * axis_y.y;
+}
+
+int viewport_cell_shift(const viewport_t * viewport, const camera_t * previous, long * dx, long * dy)
+{
+    const camera_t * const camera = viewport->camera;
+    const scanline_table_t * const table = &viewport->scanline_table;
+
+    if (0
+        || table->perspective
+        || table->effect
+        || !table->scanlines
+        || table->height == 0
+        || camera->orientation != previous->orientation
+        || camera->scale.x != previous->scale.x
+        || camera->scale.y != previous->scale.y
+    ) {
+        return 0;
+    }
+
+    vec2_t axis_x, axis_y;
+    viewport_cell_axes(viewport, camera, &axis_x, &axis_y);
+
+    const vec2_t delta = {
+        camera->position.x - previous->position.x,
+        camera->position.y - previous->position.y
+    };
+
+    *dx = lroundf((delta.x * axis_x.x + delta.y * axis_x.y) / (axis_x.x * axis_x.x + axis_x.y * axis_x.y));
+    *dy = lroundf((delta.x * axis_y.x + delta.y * axis_y.y) / (axis_y.x * axis_y.x + axis_y.y * axis_y.y));
+
+    return 1;
+}
+
+/* renders the columns of a viewport row which later viewports of the job do not cover */
+static void render_job_row(const render_job_t * job, size_t idx, size_t y)
+{
+    const viewport_t * const viewport = &job->viewports[idx];
+    const size_t row = viewport->y + y;
+    size_t x = 0;
+
+    while (x < viewport->width) {
+        /* end of the uncovered span from x, and where the covering starting there ends */
+        size_t span_end = viewport->width;
+        size_t covered_end = x;
+
+        size_t i;
+        for (i = idx + 1; i < job->viewport_count; i++) {
+            const viewport_t * const other = &job->viewports[i];
+            if (0
+                || row < other->y
+                || row >= other->y + other->height
+                || other->x + other->width <= viewport->x + x
+                || other->x >= viewport->x + viewport->width
+            ) {
+                continue;
+            }
+
+            const size_t begin = other->x > viewport->x ? other->x - viewport->x : 0;
+            const size_t end = other->x + other->width - viewport->x;
+            if (begin <= x) {
+                covered_end = end > covered_end ? end : covered_end;
+            } else if (begin < span_end) {
+                span_end = begin;
+            }
+        }
+
+        if (covered_end > x) {
+            x = covered_end < viewport->width ? covered_end : viewport->width;
+            continue;
+        }
+
+        viewport_render_span(viewport, y, x, span_end, job->sampler, job->frame, job->framebuffer);
+        x = span_end;
+    }
+}
+
+static void render_job_process(render_job_t * job)
+{
+    TRACE_ZONE("sample rows");
+
+    size_t idx = 0;
+    size_t first_row = 0;
+
+    while (1) {
+        const size_t row = __atomic_fetch_add(&job->next_row, 1, __ATOMIC_RELAXED);
+
+        /* rows are handed out in viewport order, so the viewport only moves forward */
+        while (idx < job->viewport_count && row >= first_row + job->viewports[idx].height) {
+            first_row += job->viewports[idx].height;
+            idx++;
+        }
+
+        if (idx >= job->viewport_count) {
+            break;
+        }
+
+        render_job_row(job, idx, row - first_row);
+    }
+}
+
+static void * render_pool_worker(void * arg)
+{
+    render_pool_t * const pool = arg;
+    size_t generation = 0;
+
+    TRACE_THREAD_NAME("render worker");
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        while (!pool->stop && pool->generation == generation) {
+            pthread_cond_wait(&pool->start_cond, &pool->mutex);
+        }
+
+        if (pool->stop) {
+            break;
+        }
+
+        generation = pool->generation;
+        render_job_t * const job = pool->job;
+        pthread_mutex_unlock(&pool->mutex);
+
+        render_job_process(job);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->busy_count--;
+        if (pool->busy_count == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+int render_pool_init(render_pool_t * pool, size_t thread_count)
+{
+    if (thread_count > RENDER_POOL_MAX_THREADS) {
+        thread_count = RENDER_POOL_MAX_THREADS;
+    }
+
+    pool->thread_count = 0;
+    pool->generation = 0;
+    pool->busy_count = 0;
+    pool->job = NULL;
+    pool->stop = 0;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    size_t i;
+    for (i = 0; i < thread_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, render_pool_worker, pool) != 0) {
+            render_pool_destroy(pool);
+
+            return 0;
+        }
+
+        pool->thread_count++;
+    }
+
+    return 1;
+}
+
+/* returns once every row of the job has been rendered */
+void render_pool_run(render_pool_t * pool, render_job_t * job)
+{
+    if (pool->thread_count == 0) {
+        render_job_process(job);
+
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->job = job;
+    pool->busy_count = pool->thread_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    render_job_process(job);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->busy_count > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void render_pool_destroy(render_pool_t * pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    size_t i;
+    for (i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pool->thread_count = 0;
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_cond_destroy(&pool->done_cond);
+}
+
+#ifdef ENABLE_TRACE
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer_t * trace_buffers = NULL;
+static size_t trace_thread_count = 0;
+static __thread trace_buffer_t * trace_thread_buffer = NULL;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+
+/* buffers are never freed, the dump still shows the events of exited threads */
+static void trace_buffer_release(void * arg)
+{
+    trace_buffer_t * const buffer = arg;
+
+    pthread_mutex_lock(&trace_mutex);
+    buffer->released = 1;
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+static void trace_key_create(void)
+{
+    pthread_key_create(&trace_key, trace_buffer_release);
+}
+
+/*
+ * Short-lived threads such as texture loaders take over the buffer of an exited
+ * thread, keeping its tid, so that memory is bounded by concurrent threads.
+ */
+static trace_buffer_t * trace_buffer_get(void)
+{
+    if (trace_thread_buffer) {
+        return trace_thread_buffer;
+    }
+
+    pthread_once(&trace_key_once, trace_key_create);
+
+    pthread_mutex_lock(&trace_mutex);
+    trace_buffer_t * buffer;
+    for (buffer = trace_buffers; buffer; buffer = buffer->next) {
+        if (buffer->released) {
+            break;
+        }
+    }
+
+    if (buffer) {
+        buffer->released = 0;
+    } else {
+        buffer = malloc(sizeof(*buffer));
+        if (!buffer) {
+            pthread_mutex_unlock(&trace_mutex);
+            return NULL;
+        }
+
+        buffer->count = 0;
+        buffer->thread_name = NULL;
+        buffer->released = 0;
+        buffer->tid = ++trace_thread_count;
+        buffer->next = trace_buffers;
+        trace_buffers = buffer;
+    }
+
+    pthread_mutex_unlock(&trace_mutex);
+
+    pthread_setspecific(trace_key, buffer);
+    trace_thread_buffer = buffer;
+
+    return buffer;
+}
+
+trace_zone_t trace_zone_begin(const char * name)
+{
+    const trace_zone_t zone = {name, current_time_ns()};
+
+    return zone;
+}
+
+void trace_zone_end(trace_zone_t * zone)
+{
+    trace_buffer_t * const buffer = trace_buffer_get();
+    if (!buffer) {
+        return;
+    }
+
+    trace_event_t * const event = &buffer->events[buffer->count % TRACE_BUFFER_SIZE];
+    event->name = zone->name;
+    event->begin_ns = zone->begin_ns;
+    event->end_ns = current_time_ns();
+
+    __atomic_store_n(&buffer->count, buffer->count + 1, __ATOMIC_RELEASE);
+}
+
+void trace_thread_name(const char * name)
+{
+    trace_buffer_t * const buffer = trace_buffer_get();
+    if (buffer) {
+        buffer->thread_name = name;
+    }
+}
+
+/*
+ * May be called while other threads are recording, in which case their
+ * most recent events can be missing or, on ring buffer wrap, torn.
+ */
+void trace_dump(void)
+{
+    const char * file_name = getenv("TRACE_FILE");
+    if (!file_name) {
+        file_name = "trace.json";
+    }
+
+    FILE * fp = fopen(file_name, "w");
+    if (!fp) {
+        return;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    int first = 1;
+
+    pthread_mutex_lock(&trace_mutex);
+    const trace_buffer_t * buffer;
+    for (buffer = trace_buffers; buffer; buffer = buffer->next) {
+        if (buffer->thread_name) {
+            fprintf(
+                fp,
+                "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n",
+                buffer->tid,
+                buffer->thread_name
+            );
+
+            first = 0;
+        }
+
+        const size_t count = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+        size_t i = count > TRACE_BUFFER_SIZE ? count - TRACE_BUFFER_SIZE : 0;
+        for (; i < count; i++) {
+            const trace_event_t * const event = &buffer->events[i % TRACE_BUFFER_SIZE];
+            fprintf(
+                fp,
+                "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+                first ? "" : ",\n",
+                event->name,
+                buffer->tid,
+                event->begin_ns / 1000.,
+                (event->end_ns - event->begin_ns) / 1000.
+            );
+
+            first = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&trace_mutex);
+
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+#endif
+
@@ -0,0 +1,517 @@
+/*
+ * Mode 7 render core: texture pipeline, scanline sampling and renderer mapping.
+ *
+ * Functions only work on the state they are given: textures, scanline tables,
+ * render pools, framebuffers and renderer contexts are owned by the caller, and
+ * several of each can be used at once, from different threads as long as a given
+ * object is only used by one thread at a time. Nothing is allocated per frame,
+ * only when a texture is created or a table / framebuffer is resized.
+ *
+ * Renderers draw with ncurses into the window of their context, init_color() and
+ * init_pair() are terminal wide though.
+ */
+#ifndef MODE7_H
+#define MODE7_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include <ncurses.h>
+
+/*
+ * Trace zones, compiled out unless ENABLE_TRACE is defined (TRACE=1 ./build.sh).
+ * A zone covers the enclosing scope, events are recorded in per-thread ring
+ * buffers and dumped as Chrome Trace Event JSON (to be opened in Perfetto or
+ * chrome://tracing) on exit or on demand, to $TRACE_FILE or trace.json.
+ */
+#ifdef ENABLE_TRACE
+
+typedef struct {
+    const char * name;
+    size_t begin_ns;
+} trace_zone_t;
+
+trace_zone_t trace_zone_begin(const char * name);
+void trace_zone_end(trace_zone_t * zone);
+void trace_thread_name(const char * name);
+void trace_dump(void);
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_ZONE(name) \
+    trace_zone_t TRACE_CONCAT(trace_zone_, __LINE__) __attribute__((cleanup(trace_zone_end))) = trace_zone_begin(name)
+#define TRACE_THREAD_NAME(name) trace_thread_name(name)
+#define TRACE_DUMP() trace_dump()
+
+#else
+
+#define TRACE_ZONE(name)
+#define TRACE_THREAD_NAME(name)
+#define TRACE_DUMP()
+
+#endif
+
+typedef struct {
+    size_t width;
+    size_t height;
+    uint8_t * data;
+    uint8_t colors[256][4];
+    /* file mapping, when data points into it (zero-copy load) */
+    void * mapping;
+    size_t mapping_size;
+} image_t;
+
+image_t * image_create(const char * file_name);
+void image_quantize(image_t * image, size_t max_color_count);
+void image_downsize(const image_t * image, size_t w, size_t h, uint8_t * data);
+void image_destroy(image_t * image);
+
+typedef struct {
+    size_t width;
+    size_t height;
+    size_t stride;        /* bytes per row */
+    size_t ratio;
+    uint8_t * data;
+    int ready;            /* set by the loader once data is complete */
+} texture_mimap_t;
+
+#define TEXTURE_ARENA_ALIGNMENT 64
+
+/*
+ * Palette and mipmaps live in a single aligned arena. When the texture uses at most
+ * 16 distinct colors, texels are packed two per byte (low nibble first) as indices
+ * into nibble_colors, which gives back the palette index.
+ *
+ * Textures are built by a background loader: palette, used colors, layout and level 0 are only
+ * valid once texture_ready(), other levels once their ready flag is set.
+ */
+typedef struct {
+    size_t width;
+    size_t height;
+    texture_mimap_t mipmaps[8];
+    size_t mipmap_count;
+    int packed;
+    uint8_t * nibble_colors;
+    uint8_t (*colors)[4];
+    uint8_t used_colors[256];    /* palette entries found in level 0 */
+    void * arena;
+    image_t * image;
+    size_t max_color_count;
+    pthread_t loader;
+    int loading;
+    int cancel;
+    int failed;
+} texture_t;
+
+texture_t * texture_create(const char * file_name, size_t max_color_count, size_t mipmap_count);
+int texture_wait(texture_t * texture);
+int texture_ready(const texture_t * texture);
+int texture_failed(const texture_t * texture);
+size_t texture_ready_count(const texture_t * texture);
+const texture_mimap_t * texture_level(const texture_t * texture, size_t idx);
+uint8_t texture_texel(const texture_t * texture, const texture_mimap_t * mipmap, size_t x, size_t y);
+void texture_destroy(texture_t * texture);
+
+typedef struct {
+    float nums[3][3];
+} mat3_t;
+
+typedef struct {
+    float x, y;
+} vec2_t;
+
+void mat3_identity(mat3_t * m);
+void mat3_copy(mat3_t * a, const mat3_t * b);
+void mat3_mult(mat3_t * a, const mat3_t * b);
+void mat3_translate(mat3_t * m, float x, float y);
+void mat3_scale(mat3_t * m, float x, float y);
+void mat3_rotate(mat3_t * m, float x);
+void mat3_transform(const mat3_t * m, vec2_t * v);
+
+float wrap_repeat(float v, float min, float max);
+
+/*
+ * Per-scanline rendering parameters, a la SNES HDMA tables.
+ * Everything which only depends on the row index and the screen geometry is
+ * computed once and cached here, each frame only applies the camera on top of it.
+ */
+typedef struct {
+    vec2_t scale;         /* perspective scale factor, camera zoom excluded, x per sample */
+    vec2_t origin;        /* first pixel of the row, relative to the screen center, x in samples */
+    vec2_t footprint;     /* texels covered by a sample, camera zoom excluded, x along the row, y to the next row */
+} scanline_t;
+
+typedef void (*scanline_effect_t)(scanline_t * scanline, size_t y, size_t height, size_t frame);
+
+/*
+ * Dimensions are in samples, a cell can be subdivided into several samples (braille dots),
+ * the projection itself stays defined in cells.
+ */
+typedef struct {
+    size_t width;
+    size_t height;
+    size_t subsamples_x;
+    size_t subsamples_y;
+    int perspective;
+    size_t mipmap_count;
+    vec2_t center;        /* in cells */
+    scanline_t * scanlines;
+    size_t capacity;
+    /* optional per-frame hook (curvature, wave, split horizon...), applied to a copy of each row */
+    scanline_effect_t effect;
+} scanline_table_t;
+
+void scanline_table_init(scanline_table_t * table);
+int scanline_table_update(
+    scanline_table_t * table,
+    size_t width,
+    size_t height,
+    size_t subsamples_x,
+    size_t subsamples_y,
+    int perspective,
+    size_t mipmap_count
+);
+void scanline_table_destroy(scanline_table_t * table);
+void scanline_effect_wave(scanline_t * scanline, size_t y, size_t height, size_t frame);
+size_t scanline_mipmap_level(const scanline_t * scanline, vec2_t camera_scale, size_t mipmap_count);
+size_t mipmap_level_select(float footprint, size_t mipmap_count);
+
+/*
+ * Virtual texture: a tiled mipmapped texture whose pages are loaded on demand
+ * from a file into a fixed size page cache, so that memory usage does not
+ * depend on the world size.
+ *
+ * File layout (little endian):
+ *   "TM7VT001", width, height, page size, mipmap count (u32), 256 RGBA colors,
+ *   then from VTEXTURE_DATA_OFFSET the pages of each mipmap level, finest first,
+ *   row-major, page size * page size texels each.
+ */
+#define VTEXTURE_MAGIC "TM7VT001"
+#define VTEXTURE_DATA_OFFSET 4096
+#define VTEXTURE_PAGE_SIZE 64
+#define VTEXTURE_CACHE_PAGES 512
+#define VTEXTURE_HASH_SIZE 1024
+#define VTEXTURE_REQUEST_CAPACITY 256
+#define VTEXTURE_LOADS_PER_FRAME 32
+#define VTEXTURE_KEY(level, px, py) ((uint32_t) (level) << 28 | (uint32_t) (py) << 14 | (uint32_t) (px))
+#define VTEXTURE_KEY_NONE UINT32_MAX
+
+typedef struct {
+    uint32_t key;
+    size_t last_used;
+    int pinned;
+    int hash_next;
+    uint8_t * data;
+} vtexture_page_t;
+
+typedef struct {
+    int fd;
+    size_t width;
+    size_t height;
+    size_t page_size;
+    size_t mipmap_count;
+    uint8_t colors[256][4];
+    /* per level page grid size and index of its first page in the file */
+    size_t level_pages_x[8];
+    size_t level_pages_y[8];
+    size_t level_first_page[8];
+
+    vtexture_page_t pages[VTEXTURE_CACHE_PAGES];
+    uint8_t * page_data;
+    int hash[VTEXTURE_HASH_SIZE];
+
+    uint32_t requests[VTEXTURE_REQUEST_CAPACITY];
+    size_t request_count;
+
+    size_t frame;
+    size_t frame_load_count;
+    size_t resident_count;
+    size_t miss_count;
+    size_t load_count;
+} vtexture_t;
+
+/* last page hit, to skip the page lookup for consecutive texels of a row */
+typedef struct {
+    uint32_t key;
+    uint32_t missing_key;
+    const vtexture_page_t * page;
+} vtexture_cursor_t;
+
+int vtexture_write(const texture_t * texture, const char * file_name);
+vtexture_t * vtexture_open(const char * file_name);
+void vtexture_close(vtexture_t * vtexture);
+void vtexture_cursor_init(vtexture_cursor_t * cursor);
+uint8_t vtexture_sample(vtexture_t * vtexture, vtexture_cursor_t * cursor, size_t level, float x, float y);
+void vtexture_update(vtexture_t * vtexture);
+void vtexture_prefetch(vtexture_t * vtexture, vec2_t position, vec2_t direction);
+
+/*
+ * Colors and pairs as last sent to the terminal, shared by the renderer contexts of a
+ * terminal. init_color() and init_pair() are only called for entries which change, so
+ * that re-initializing a renderer costs nothing and cycling a few palette entries costs
+ * a few sequences instead of repainting cells.
+ */
+#define PALETTE_SHADOW_PAIRS 257
+
+typedef struct {
+    short colors[256][3];
+    short pairs[PALETTE_SHADOW_PAIRS][2];
+    uint8_t color_known[256];
+    uint8_t pair_known[PALETTE_SHADOW_PAIRS];
+    size_t upload_count;      /* sequences actually sent */
+} palette_shadow_t;
+
+void palette_shadow_init(palette_shadow_t * shadow);
+void palette_shadow_color(palette_shadow_t * shadow, size_t idx, short r, short g, short b);
+void palette_shadow_pair(palette_shadow_t * shadow, size_t idx, short fg, short bg);
+
+/* copies colors, rotating the entries listed in indices by phase */
+void palette_cycle(uint8_t colors[][4], const uint8_t * indices, size_t count, size_t phase, uint8_t cycled[][4]);
+
+typedef struct renderer_s renderer_t;
+
+/* what a renderer draws to, and what it remembers between cells */
+typedef struct {
+    const renderer_t * renderer;
+    WINDOW * window;
+    palette_shadow_t * palette;
+    int last_color_idx;
+    /* for each palette color, the dots lit by ordered dithering (braille) */
+    uint8_t color_dots[256];
+} renderer_context_t;
+
+/* block renderers draw a cell from block_width x block_height texels */
+struct renderer_s {
+    const char * name;
+    size_t block_width;
+    size_t block_height;
+    void (*init)(renderer_context_t *, uint8_t [][4]);
+    void (*draw)(renderer_context_t *, size_t, size_t, uint8_t [][4], uint8_t);
+    void (*draw_block)(renderer_context_t *, size_t, size_t, const uint8_t *, size_t);
+};
+
+#define RENDERER_COUNT 4
+
+/* braille, monochrome, 16 colors, 256 colors */
+extern const renderer_t renderers[RENDERER_COUNT];
+
+void renderer_context_init(
+    renderer_context_t * context,
+    const renderer_t * renderer,
+    WINDOW * window,
+    palette_shadow_t * palette
+);
+
+/* terminal colors and pairs, saved before renderers change them */
+typedef struct {
+    int saved;
+    size_t color_count;
+    size_t pair_count;
+    short colors[256][3];
+    short pairs[256][2];
+} palette_backup_t;
+
+void palette_backup_save(palette_backup_t * backup);
+/* only sends back the entries which differ from what the shadow says the terminal has */
+void palette_backup_restore(const palette_backup_t * backup, palette_shadow_t * shadow);
+
+size_t current_time_ns(void);
+
+typedef struct {
+    float acceleration;
+    float deceleration;
+    float max;
+
+    float velocity;
+
+    int active;
+    int reverse;
+} accelerator_t;
+
+void accelerator_init(accelerator_t * accelerator, float acceleration, float deceleration, float max);
+void accelerator_press(accelerator_t * accelerator, int reverse);
+void accelerator_release(accelerator_t * accelerator);
+float accelerator_step(accelerator_t * accelerator, float time);
+float accelerator_velocity(const accelerator_t * accelerator);
+
+typedef struct {
+    vec2_t position;
+    vec2_t scale;
+    float orientation;
+    accelerator_t move_accelerator;
+    accelerator_t turn_accelerator;
+} camera_t;
+
+/* simulation runs at a fixed rate, independently of rendering */
+#define SIMULATION_RATE 240
+#define SIMULATION_STEP_NS (1000 * 1000 * 1000 / SIMULATION_RATE)
+/* bound catch-up after a stall, simulation time is dropped beyond that */
+#define SIMULATION_MAX_STEPS (SIMULATION_RATE / 4)
+
+void camera_init(camera_t * camera, vec2_t position, vec2_t scale, float orientation);
+void camera_step(camera_t * camera, float time);
+void camera_interpolate(const camera_t * previous, const camera_t * next, float alpha, camera_t * interpolated);
+void camera_predict(const camera_t * camera, float time, camera_t * predicted);
+
+typedef struct {
+    size_t width;
+    size_t height;
+    uint8_t * data;
+} framebuffer_t;
+
+void framebuffer_init(framebuffer_t * framebuffer);
+int framebuffer_resize(framebuffer_t * framebuffer, size_t width, size_t height);
+void framebuffer_destroy(framebuffer_t * framebuffer);
+
+size_t renderer_draw_framebuffer(
+    renderer_context_t * context,
+    const framebuffer_t * framebuffer,
+    uint8_t colors[][4],
+    size_t frame
+);
+
+/* draws every cell of a rectangle, in cells, without interleaving */
+size_t renderer_draw_rect(
+    renderer_context_t * context,
+    const framebuffer_t * framebuffer,
+    uint8_t colors[][4],
+    size_t x,
+    size_t y,
+    size_t width,
+    size_t height
+);
+
+/*
+ * Moves what the window shows so that cell (x, y) gets the content of (x + dx, y + dy),
+ * within a rectangle in cells, exposed cells are left blank. Rows are scrolled whole
+ * (scroll region): the caller can scroll the terminal the same way, so that only
+ * exposed and changed cells are sent.
+ */
+void renderer_shift(
+    renderer_context_t * context,
+    size_t x,
+    size_t y,
+    size_t width,
+    size_t height,
+    long dx,
+    long dy
+);
+
+/*
+ * Overlays are small indexed buffers (minimap, HUD) composited over the framebuffer
+ * after the mode7 pass. The framebuffer is drawn interleaved, so overlays keep the
+ * rectangles which changed since they were last drawn and only those are drawn in
+ * full: a static overlay costs nothing, a moving marker the cells it leaves and enters.
+ * Positions and sizes are in samples, dirty rectangles are drawn as whole cells.
+ */
+#define OVERLAY_DIRTY_RECTS 4
+
+typedef struct {
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+} overlay_rect_t;
+
+typedef struct {
+    size_t x;
+    size_t y;
+    framebuffer_t buffer;
+    overlay_rect_t dirty[OVERLAY_DIRTY_RECTS];
+    size_t dirty_count;
+} overlay_t;
+
+void overlay_init(overlay_t * overlay);
+int overlay_resize(overlay_t * overlay, size_t width, size_t height);
+void overlay_destroy(overlay_t * overlay);
+void overlay_invalidate(overlay_t * overlay, size_t x, size_t y, size_t width, size_t height);
+void overlay_invalidate_all(overlay_t * overlay);
+void overlay_composite(const overlay_t * overlay, framebuffer_t * framebuffer);
+size_t overlay_draw_dirty(
+    overlay_t * overlay,
+    renderer_context_t * context,
+    const framebuffer_t * framebuffer,
+    uint8_t colors[][4]
+);
+
+/* where texels come from: a texture, or a virtual texture */
+typedef struct {
+    const texture_t * texture;
+    vtexture_t * vtexture;
+    vec2_t padding_box_pos;
+    size_t padding_box_size;
+} sampler_t;
+
+/* a screen rectangle rendered from a camera */
+typedef struct {
+    const camera_t * camera;
+    float orientation_offset;
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+    scanline_table_t scanline_table;
+} viewport_t;
+
+void viewport_render_row(
+    const viewport_t * viewport,
+    size_t y,
+    const sampler_t * sampler,
+    size_t frame,
+    framebuffer_t * framebuffer
+);
+void viewport_render_span(
+    const viewport_t * viewport,
+    size_t y,
+    size_t x_begin,
+    size_t x_end,
+    const sampler_t * sampler,
+    size_t frame,
+    framebuffer_t * framebuffer
+);
+
+/*
+ * Without perspective a viewport is an affine map of the cell grid: moving the camera
+ * by whole cells along the view axes shifts the image by whole cells. Snapping rounds
+ * the camera position to that grid (no-op in perspective mode), the cell shift from a
+ * previous snapped camera is only defined when nothing but the position changed.
+ */
+void viewport_snap_camera(const viewport_t * viewport, camera_t * camera);
+int viewport_cell_shift(const viewport_t * viewport, const camera_t * previous, long * dx, long * dy);
+
+#define RENDER_POOL_MAX_THREADS 8
+
+/*
+ * The rows of every viewport of a frame, shared by the pool in one pass. Later viewports
+ * overlap earlier ones: covered columns of earlier viewports are not rendered, so that
+ * rows can be sampled in any order.
+ */
+typedef struct {
+    const viewport_t * viewports;
+    size_t viewport_count;
+    const sampler_t * sampler;
+    size_t frame;
+    framebuffer_t * framebuffer;
+    size_t next_row;
+} render_job_t;
+
+/* worker threads sharing the rows of a job with the calling thread */
+typedef struct {
+    pthread_t threads[RENDER_POOL_MAX_THREADS];
+    size_t thread_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    size_t generation;
+    size_t busy_count;
+    render_job_t * job;
+    int stop;
+} render_pool_t;
+
+int render_pool_init(render_pool_t * pool, size_t thread_count);
+void render_pool_run(render_pool_t * pool, render_job_t * job);
+void render_pool_destroy(render_pool_t * pool);
+
+#endif